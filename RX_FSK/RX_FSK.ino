@@ -16,6 +16,7 @@
 #include <Sonde.h>
 #include <Display.h>
 #include <Scanner.h>
+#include <Bench.h>
 #include <aprs.h>
 #include "version.h"
 #include "geteph.h"
@@ -73,6 +74,7 @@ String ledState;
 
 // timestamp when spectrum display was activated
 static unsigned long specTimer;
+static int specPeak;  // selected peak of spectrum scan
 
 // Replaces placeholder with LED state value
 String processor(const String& var) {
@@ -96,9 +98,10 @@ String processor(const String& var) {
   return String();
 }
 
+// activeType 4: autodetect
 const String sondeTypeSelect(int activeType) {
   String sts = "";
-  for (int i = 0; i < 4; i++) {
+  for (int i = 0; i < 5; i++) {
     sts += "<option value=\"";
     sts += sondeTypeStr[i];
     sts += "\"";
@@ -141,7 +144,11 @@ void setupChannelList() {
     *space = 0;
     float freq = atof(line.c_str());
     SondeType type;
-    if (space[1] == '4') {
+    bool autodetect = false;
+    if (space[1] == 'A') {
+      type = STYPE_RS41;   // tried first by autodetection
+      autodetect = true;
+    } else if (space[1] == '4') {
       type = STYPE_RS41;
     } else if (space[1] == 'R') {
       type = STYPE_RS92;
@@ -153,7 +160,13 @@ void setupChannelList() {
       type = STYPE_DFM06;
     }
     else continue;
-    int active = space[3] == '+' ? 1 : 0;
+    // '+' active, '-' inactive, '1'..'9' active with scheduler priority
+    int active = 0, prio = 1;
+    if (space[3] == '+') active = 1;
+    else if (space[3] >= '1' && space[3] <= '9') {
+      active = 1;
+      prio = space[3] - '0';
+    }
     if (space[4] == ' ') {
       memset(launchsite, ' ', 16);
       int str_len = strlen(space + 5);
@@ -162,7 +175,8 @@ void setupChannelList() {
         Serial.printf("Add %f - sondetype: %d (on/off: %d) - site #%d - name: %s\n ", freq, type, active, i, launchsite);
       }
     }
-    sonde.addSonde(freq, type, active, launchsite);
+    sonde.addSonde(freq, type, active, launchsite, prio);
+    if (autodetect) sonde.sondeList[sonde.nSonde - 1].autodetect = true;
     i++;
   }
   file.close();
@@ -170,19 +184,24 @@ void setupChannelList() {
 
 const char *createQRGForm() {
   char *ptr = message;
-  strcpy(ptr, "<html><head><link rel=\"stylesheet\" type=\"text/css\" href=\"style.css\"></head><body><form action=\"qrg.html\" method=\"post\"><table><tr><th>ID</th><th>Active</th><th>Freq</th><th>Launchsite</th><th>Mode</th></tr>");
+  strcpy(ptr, "<html><head><link rel=\"stylesheet\" type=\"text/css\" href=\"style.css\"></head><body><form action=\"qrg.html\" method=\"post\"><table><tr><th>ID</th><th>Active</th><th>Freq</th><th>Launchsite</th><th>Mode</th><th>Prio</th></tr>");
+  // temporary channels (spectrum peaks) are not part of qrg.txt and not listed
+  int j = 0;
   for (int i = 0; i < sonde.config.maxsonde; i++) {
-    String s = sondeTypeSelect(i >= sonde.nSonde ? 2 : sonde.sondeList[i].type);
-    String site = sonde.sondeList[i].launchsite;
+    while (j < sonde.nSonde && sonde.sondeList[j].temp) j++;
+    SondeInfo *si = j < sonde.nSonde ? &sonde.sondeList[j++] : NULL;
+    String s = sondeTypeSelect(!si ? 2 : si->autodetect ? 4 : si->type);
     sprintf(ptr + strlen(ptr), "<tr><td>%d</td><td><input name=\"A%d\" type=\"checkbox\" %s/></td>"
             "<td><input name=\"F%d\" type=\"text\" value=\"%3.3f\"></td>"
             "<td><input name=\"S%d\" type=\"text\" value=\"%s\"></td>"
-            "<td><select name=\"T%d\">%s</select></td>",
+            "<td><select name=\"T%d\">%s</select></td>"
+            "<td><input name=\"P%d\" type=\"text\" size=\"1\" value=\"%d\"></td>",
             i + 1,
-            i + 1, (i < sonde.nSonde && sonde.sondeList[i].active) ? "checked" : "",
-            i + 1, i >= sonde.nSonde ? 400.000 : sonde.sondeList[i].freq,
-            i + 1, i >= sonde.nSonde ? "                " : sonde.sondeList[i].launchsite,
-            i + 1, s.c_str());
+            i + 1, (si && si->active) ? "checked" : "",
+            i + 1, !si ? 400.000 : si->freq,
+            i + 1, !si ? "                " : si->launchsite,
+            i + 1, s.c_str(),
+            i + 1, !si ? 1 : si->prio);
   }
   strcat(ptr, "</table><input type=\"submit\" value=\"Update\"/></form></body></html>");
   return message;
@@ -217,6 +236,9 @@ const char *handleQRGPost(AsyncWebServerRequest *request) {
     snprintf(label, 10, "T%d", i);
     AsyncWebParameter *type = request->getParam(label, true);
     if (!type) continue;
+    snprintf(label, 10, "P%d", i);
+    AsyncWebParameter *prioparam = request->getParam(label, true);
+    int prio = prioparam ? atoi(prioparam->value().c_str()) : 1;
     String fstring = freq->value();
     String tstring = type->value();
     String sstring = launchsite->value();
@@ -224,8 +246,9 @@ const char *handleQRGPost(AsyncWebServerRequest *request) {
     const char *tstr = tstring.c_str();
     const char *sstr = sstring.c_str();
     Serial.printf("Processing a=%s, f=%s, t=%s, site=%s\n", active ? "YES" : "NO", fstr, tstr, sstr);
-    char typech = (tstr[2] == '4' ? '4' : tstr[2] == '9' ? 'R' : tstr[3]);   // a bit ugly
-    file.printf("%3.3f %c %c %s\n", atof(fstr), typech, active ? '+' : '-', sstr);
+    char typech = (tstr[0] == 'A' ? 'A' : tstr[2] == '4' ? '4' : tstr[2] == '9' ? 'R' : tstr[3]);   // a bit ugly
+    char activech = !active ? '-' : (prio > 1 && prio <= 9) ? '0' + prio : '+';
+    file.printf("%3.3f %c %c %s\n", atof(fstr), typech, activech, sstr);
   }
   file.close();
 
@@ -392,11 +415,16 @@ struct st_configitems config_list[] = {
   {"spectrum", "ShowSpectrum (s)", 0, &sonde.config.spectrum},
   {"startfreq", "Startfreq (MHz)", 0, &sonde.config.startfreq},
   {"channelbw", "Bandwidth (kHz)", 0, &sonde.config.channelbw},
+  {"scanrange", "Scan range (MHz)", 0, &sonde.config.scanrange},
   {"timer", "Spectrum Timer", 0, &sonde.config.timer},
   {"marker", "Spectrum MHz marker", 0, &sonde.config.marker},
   {"noisefloor", "Sepctrum noisefloor", 0, &sonde.config.noisefloor},
   {"showafc", "Show AFC value", 0, &sonde.config.showafc},
   {"freqofs", "RX frequency offset (Hz)", 0, &sonde.config.freqofs},
+  {"capture", "Record received frames (0/1)", 0, &sonde.config.capture},
+  {"bench", "Decoder benchmark on startup (0/1)", 0, &sonde.config.bench},
+  {"sched", "Multi-sonde scheduler (0/1)", 0, &sonde.config.sched},
+  {"detecttime", "Type autodetect time (ms)", 0, &sonde.config.detecttime},
   {"---", "---", -1, NULL},
   /* APRS settings */
   {"call", "Call", 8, sonde.config.call},
@@ -440,6 +468,9 @@ struct st_configitems config_list[] = {
   {"led_pout", "LED output port (needs reboot)", 0, &sonde.config.led_pout},
   {"gps_rxd", "GPS RXD pin (-1 to disable)", 0, &sonde.config.gps_rxd},
   {"gps_txd", "GPS TXD pin (not really needed)", 0, &sonde.config.gps_txd},
+  {"sx1278_dio0", "SX1278 DIO0 pin (-1 to disable) (needs reboot)", 0, &sonde.config.sx1278_dio0},
+  {"sx1278_dio1", "SX1278 DIO1 pin (-1 to disable) (needs reboot)", 0, &sonde.config.sx1278_dio1},
+  {"sx1278_dio2", "SX1278 DIO2 pin (-1 to disable) (needs reboot)", 0, &sonde.config.sx1278_dio2},
 };
 const static int N_CONFIG = (sizeof(config_list) / sizeof(struct st_configitems));
 
@@ -912,8 +943,9 @@ void sx1278Task(void *parameter) {
       This task is a simple infinit loop that
        (a) initially and after frequency or mode change calls <decoder>.setup()
        (b) then repeatedly calls <decoder>.receive() which should
-           (1) update data in the Sonde structure (additional updates may be done later in main loop/waitRXcomplete)
-           (2) set output flag receiveResult (success/error/timeout and keybord events)
+           (1) update data in sonde.rxsi() (additional updates may be done later in main loop/waitRXcomplete)
+           (2) after that, sonde.receive() passes the result (success/error/timeout and keybord events)
+               and the decoded data to the main loop via rxqueue
 
   */
   while (1) {
@@ -934,8 +966,9 @@ void sx1278Task(void *parameter) {
       delay(100);
       continue;
     }
+    // receive() sleeps in sx1278.waitDIO() until data is available
     sonde.receive();
-    delay(20);
+    delay(1);
   }
 }
 
@@ -1248,6 +1281,7 @@ void setup()
 
   //sx1278.setLNAGain(-48);
   sx1278.setLNAGain(0);
+  sx1278.setDIOPins(sonde.config.sx1278_dio0, sonde.config.sx1278_dio1, sonde.config.sx1278_dio2);
 
   int gain = sx1278.getLNAGain();
   Serial.print("RX LNA Gain is ");
@@ -1280,6 +1314,10 @@ void setup()
   /// not here, done by sonde.setup(): rs41.setup();
   // == setup default channel list if qrg.txt read fails =========== //
 
+  if (sonde.config.bench) {
+    runBenchmark("/spiffs/");
+  }
+
   xTaskCreate( sx1278Task, "sx1278Task",
                10000, /* stack size */
                NULL, /* paramter */
@@ -1311,7 +1349,10 @@ void enterMode(int mode) {
     sonde.clearDisplay();
     disp.rdis->setFont(FONT_SMALL);
     specTimer = millis();
-    //scanner.init();
+    specPeak = 0;
+    // peaks of a previous scan that never decoded are dropped (rx task is inactive here)
+    sonde.clearCandidates();
+    scanner.init();
   } else if (mainState == ST_WIFISCAN) {
     sonde.clearDisplay();
   }
@@ -1405,22 +1446,43 @@ void loopDecoder() {
       }
     }
   }
+  // if the next frame is already waiting, display it instead of this one
+  if (sonde.rxPending()) return;
   Serial.println("updateDisplay started");
   sonde.updateDisplay();
   Serial.println("updateDisplay done");
 }
 
 
+// peaks closer than one channel (at least 10 kHz) to a known channel are the same sonde
+static float specTolerance() {
+  return (sonde.config.channelbw < 10 ? 10 : sonde.config.channelbw) / 1000.0;
+}
+
 void loopSpectrum() {
   int marker = 0;
   char buf[10];
 
   switch (getKeyPress()) {
-    case KP_SHORT: /* move selection of peak, TODO */
-      sonde.nextConfig(); // TODO: Should be set specific frequency
-      enterMode(ST_DECODER);
-      return;
-    case KP_MID: /* restart, TODO */ break;
+    case KP_SHORT: /* move selection to next peak */
+      if (scanner.npeaks == 0) {
+        sonde.nextConfig();
+        enterMode(ST_DECODER);
+        return;
+      }
+      specPeak = (specPeak + 1) % scanner.npeaks;
+      break;
+    case KP_MID: /* decode selected peak */
+      if (specPeak < scanner.npeaks) {
+        int idx = sonde.addCandidate(scanner.peaks[specPeak].freq, specTolerance());
+        if (idx >= 0) {
+          sonde.currentSonde = idx;
+          enterMode(ST_DECODER);
+          return;
+        }
+      }
+      scanner.init();  // restart sweep
+      break;
     case KP_LONG:
       Serial.println("loopSpectrum: KP_LONG");
       enterMode(ST_WIFISCAN);
@@ -1432,13 +1494,26 @@ void loopSpectrum() {
     default: break;
   }
 
-  scanner.scan();
-  scanner.plotResult();
+  // measure a slice of channels and update the changed part of the plot,
+  // so that key presses are handled during a sweep
+  bool complete = scanner.scanSlice(SCAN_SLICE);
+  scanner.plotResult(false);
+  if (!complete) return;
+  // new signals become temporary channels with type autodetection
+  for (int i = 0; i < scanner.npeaks; i++) {
+    sonde.addCandidate(scanner.peaks[i].freq, specTolerance());
+  }
+  if (specPeak >= scanner.npeaks) specPeak = 0;
+  if (scanner.npeaks > 0) {
+    char fbuf[10];
+    snprintf(fbuf, 10, "%.3f", scanner.peaks[specPeak].freq);
+    disp.rdis->drawString(9, 1 + (sonde.config.marker != 0), fbuf);
+  }
   if (sonde.config.marker != 0) {
     itoa((sonde.config.startfreq), buf, 10);
     disp.rdis->drawString(0, 1, buf);
     disp.rdis->drawString(7, 1, "MHz");
-    itoa((sonde.config.startfreq + 6), buf, 10);
+    itoa((sonde.config.startfreq + sonde.config.scanrange), buf, 10);
     disp.rdis->drawString(13, 1, buf);
   }
   if (sonde.config.timer) {
@@ -10,30 +10,92 @@
  */
 
 #include "SX1278FSK.h"
+#include "SX1278Sim.h"
 #include "SPI.h"
 #include <Sonde.h>
 #include <Display.h>
 
+static SX1278SPIRadio spiradio;
+
 SX1278FSK::SX1278FSK()
 {
 	// Initialize class variables
+	radio = &spiradio;
+	capture = NULL;
+	diomode = false;
+	fifodio = false;
+	memset(&fifostat, 0, sizeof(fifostat));
+	memset(&rxquality, 0, sizeof(rxquality));
+	spiradio.dio[0] = spiradio.dio[1] = spiradio.dio[2] = -1;
 };
 
+// task waiting in waitDIO
+static TaskHandle_t diotask = NULL;
 
-static SPISettings spiset = SPISettings(40000000L, MSBFIRST, SPI_MODE0);
+// Called on DIO rising edge, by GPIO interrupt or by the simulated radio
+static void IRAM_ATTR dioISR()
+{
+	if(!diotask) return;
+	if(xPortInIsrContext()) {
+		BaseType_t woken = pdFALSE;
+		vTaskNotifyGiveFromISR(diotask, &woken);
+		if(woken) portYIELD_FROM_ISR();
+	} else {
+		xTaskNotifyGive(diotask);
+	}
+}
 
-/*
-Function: Turns the module ON.
-Returns: 0 on success, 1 otherwise
-*/
-uint8_t SX1278FSK::ON()
+void SX1278FSK::setRadio(SX1278Radio *r)
 {
-	uint8_t state = 2;
-#if (SX1278FSK_debug_mode > 1)
-	Serial.println();
-	Serial.println(F("Starting 'ON'"));
-#endif
+	radio->attachDIO(NULL);
+	radio = r ? r : &spiradio;
+	diomode = radio->attachDIO(dioISR);
+	fifodio = diomode && (radio != &spiradio || spiradio.dio[1] >= 0);
+}
+
+void SX1278FSK::setDIOPins(int dio0, int dio1, int dio2)
+{
+	spiradio.attachDIO(NULL);
+	spiradio.dio[0] = dio0;
+	spiradio.dio[1] = dio1;
+	spiradio.dio[2] = dio2;
+	if(radio == &spiradio) {
+		diomode = spiradio.attachDIO(dioISR);
+		fifodio = diomode && dio1 >= 0;
+	}
+	Serial.printf("SX1278 DIO pins %d/%d/%d: %s\n", dio0, dio1, dio2, diomode ? "interrupt" : "polling");
+}
+
+void SX1278FSK::waitDIO(uint32_t ms)
+{
+	if(!diomode) {
+		delay(ms<SX1278_POLL_MS ? ms : SX1278_POLL_MS);
+		return;
+	}
+	diotask = xTaskGetCurrentTaskHandle();
+	ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+}
+
+uint32_t SX1278FSK::fifoWait(uint32_t ms)
+{
+	if(fifodio) return ms;
+	// Without FifoLevel interrupt, nothing wakes us up while the FIFO fills:
+	// wake up before the bytes above the burst threshold would overrun it
+	uint32_t fill = (uint32_t)((SX1278_FIFO_SIZE - SX1278_FIFO_BURST) * 8000 / getBitrate());
+	if(fill < 1) fill = 1;
+	return fill < ms ? fill : ms;
+}
+
+SX1278Radio *SX1278FSK::getRadio()
+{
+	return radio;
+}
+
+
+static SPISettings spiset = SPISettings(40000000L, MSBFIRST, SPI_MODE0);
 
+void SX1278SPIRadio::begin()
+{
 	// Powering the module
 	pinMode(SX1278_SS, OUTPUT);
 	digitalWrite(SX1278_SS, HIGH);
@@ -46,6 +108,98 @@ uint8_t SX1278FSK::ON()
 	SPI.setClockDivider(SPI_CLOCK_DIV2);
 	//Set data mode
 	SPI.setDataMode(SPI_MODE0);
+}
+
+void SX1278SPIRadio::end()
+{
+	SPI.end();
+	// Powering the module
+	pinMode(SX1278_SS,OUTPUT);
+	digitalWrite(SX1278_SS,LOW);
+}
+
+byte SX1278SPIRadio::readRegister(byte address)
+{
+	byte value = 0x00;
+
+	SPI.beginTransaction(spiset);
+	digitalWrite(SX1278_SS,LOW);
+
+	//delay(1);
+	bitClear(address, 7);		// Bit 7 cleared to write in registers
+	SPI.transfer(address);
+	value = SPI.transfer(0x00);
+	digitalWrite(SX1278_SS,HIGH);
+	SPI.endTransaction();
+	return value;
+}
+
+void SX1278SPIRadio::writeRegister(byte address, byte data)
+{
+	SPI.beginTransaction(spiset);
+	digitalWrite(SX1278_SS,LOW);
+
+	//delay(1);
+	bitSet(address, 7);			// Bit 7 set to read from registers
+	SPI.transfer(address);
+	SPI.transfer(data);
+	digitalWrite(SX1278_SS,HIGH);
+	SPI.endTransaction();
+}
+
+void SX1278SPIRadio::readBurst(byte address, byte *data, int len)
+{
+	SPI.beginTransaction(spiset);
+	digitalWrite(SX1278_SS,LOW);
+
+	bitClear(address, 7);
+	SPI.transfer(address);
+	SPI.transferBytes(NULL, data, len);	// address auto-increment does not apply to FIFO
+	digitalWrite(SX1278_SS,HIGH);
+	SPI.endTransaction();
+}
+
+void SX1278SPIRadio::writeBurst(byte address, const byte *data, int len)
+{
+	SPI.beginTransaction(spiset);
+	digitalWrite(SX1278_SS,LOW);
+
+	bitSet(address, 7);
+	SPI.transfer(address);
+	SPI.writeBytes(data, len);
+	digitalWrite(SX1278_SS,HIGH);
+	SPI.endTransaction();
+}
+
+bool SX1278SPIRadio::attachDIO(void (*handler)())
+{
+	bool any = false;
+	for(int i=0; i<3; i++) {
+		if(dio[i]<0) continue;
+		if(handler) {
+			pinMode(dio[i], INPUT);
+			attachInterrupt(digitalPinToInterrupt(dio[i]), handler, RISING);
+			any = true;
+		} else {
+			detachInterrupt(digitalPinToInterrupt(dio[i]));
+		}
+	}
+	return any;
+}
+
+/*
+Function: Turns the module ON.
+Returns: 0 on success, 1 otherwise
+*/
+uint8_t SX1278FSK::ON()
+{
+	uint8_t state = 2;
+#if (SX1278FSK_debug_mode > 1)
+	Serial.println();
+	Serial.println(F("Starting 'ON'"));
+#endif
+
+	radio->begin();
 
 	// Set Maximum Over Current Protection
 	state = setMaxCurrent(0x1B);
@@ -77,10 +231,7 @@ void SX1278FSK::OFF()
 	Serial.println(F("Starting 'OFF'"));
 #endif
 
-	SPI.end();
-	// Powering the module
-	pinMode(SX1278_SS,OUTPUT);
-	digitalWrite(SX1278_SS,LOW);
+	radio->end();
 
 #if (SX1278FSK_debug_mode > 1)
 	Serial.println(F("## Setting OFF ##"));
@@ -96,17 +247,7 @@ Parameters:
 */
 byte SX1278FSK::readRegister(byte address)
 {
-	byte value = 0x00;
-
-	SPI.beginTransaction(spiset);
-	digitalWrite(SX1278_SS,LOW);
-
-	//delay(1);
-	bitClear(address, 7);		// Bit 7 cleared to write in registers
-	SPI.transfer(address);
-	value = SPI.transfer(0x00);
-	digitalWrite(SX1278_SS,HIGH);
-	SPI.endTransaction();
+	byte value = radio->readRegister(address);
 
 #if (SX1278FSK_debug_mode > 1)
 	if(address!=0x3F) {
@@ -131,20 +272,11 @@ Parameters:
 */
 void SX1278FSK::writeRegister(byte address, byte data)
 {
-	SPI.beginTransaction(spiset);
-	digitalWrite(SX1278_SS,LOW);
-
-	//delay(1);
-	bitSet(address, 7);			// Bit 7 set to read from registers
-	SPI.transfer(address);
-	SPI.transfer(data);
-	digitalWrite(SX1278_SS,HIGH);
-	SPI.endTransaction();
+	radio->writeRegister(address, data);
 
 #if (SX1278FSK_debug_mode > 1)
 	Serial.print(F("## Writing:  ##\t"));
 	Serial.print(F("Register "));
-	bitClear(address, 7);
 	Serial.print(address, HEX);
 	Serial.print(F(":  "));
 	Serial.print(data, HEX);
@@ -183,6 +315,42 @@ void SX1278FSK::clearIRQFlags()
 #endif
 }
 
+byte SX1278FSK::getFifoFlags()
+{
+	byte value = readRegister(REG_IRQ_FLAGS2);
+	if( bitRead(value, 4) ) {
+		// FIFO is unusable after an overrun until the flag is cleared
+		fifostat.overruns++;
+		Serial.println("FIFO overrun");
+		writeRegister(REG_IRQ_FLAGS2, 0x10);
+		value = readRegister(REG_IRQ_FLAGS2) | 0x10;
+	}
+	return value;
+}
+
+void SX1278FSK::markBad(int from, int to)
+{
+	if(rxquality.nbad>0 && rxquality.badto[rxquality.nbad-1]>=from) {
+		// extend previous range
+		if(to>rxquality.badto[rxquality.nbad-1]) rxquality.badto[rxquality.nbad-1] = to;
+		return;
+	}
+	if(rxquality.nbad>=SX1278_MAXBAD) return;
+	rxquality.badfrom[rxquality.nbad] = from;
+	rxquality.badto[rxquality.nbad] = to;
+	rxquality.nbad++;
+}
+
+void SX1278FSK::readFifo(byte *data, int len, byte flags)
+{
+	if(len<=0) return;
+	// FIFO full: one more byte on air would have been lost
+	if( bitRead(flags, 7) ) fifostat.avoided++;
+	radio->readBurst(REG_FIFO, data, len);
+	fifostat.bursts++;
+	fifostat.bytes += len;
+}
+
 /*
 Function: Sets the module in FSK mode.
 Returns:   Integer that determines if there has been any error
@@ -209,6 +377,10 @@ uint8_t SX1278FSK::setFSK()
 	writeRegister(REG_OP_MODE, FSK_STANDBY_MODE);	// FSK standby mode
 
 	//writeRegister(REG_FIFO_THRESH, 0x80);	// condition to start packet tx
+	// FifoLevel flag as soon as one burst can be read
+	writeRegister(REG_FIFO_THRESH, SX1278_FIFO_BURST-1);
+	// DIO0: PayloadReady, DIO1: FifoLevel, DIO2: SyncAddress (packet mode mapping)
+	writeRegister(REG_DIO_MAPPING1, 0x0C);
 	//config1 = readRegister(REG_SYNC_CONFIG);
 	//config1 = config1 & B00111111;
 	//writeRegister(REG_SYNC_CONFIG,config1);
@@ -344,6 +516,22 @@ uint8_t SX1278FSK::setFrequency(float freq) {
 	return 0;
 }
 
+void SX1278FSK::setFrf(uint32_t frf) {
+	byte b[3] = { (byte)(frf>>16), (byte)(frf>>8), (byte)frf };
+	radio->writeBurst(REG_FRF_MSB, b, 3);
+}
+
+uint8_t SX1278FSK::fastHop(float freq) {
+	freq += sonde.config.freqofs;  // manual frequency correction
+
+	uint32_t frf = freq * 1.0 * (1<<19) / SX127X_CRYSTAL_FREQ;
+	writeRegister(REG_PLL_HOP, readRegister(REG_PLL_HOP) | 0x80);   // FastHopOn
+	setFrf(frf);
+	// RestartRxWithPllLock: new AFC/AGC and preamble detection on the new frequency
+	writeRegister(REG_RX_CONFIG, readRegister(REG_RX_CONFIG) | 0x20);
+	return 0;
+}
+
 float SX1278FSK::getFrequency() {
 	uint8_t fmsb = readRegister(REG_FRF_MSB);
 	uint8_t fmid = readRegister(REG_FRF_MID);
@@ -484,6 +672,7 @@ int SX1278FSK::getPayloadLength()
 	Serial.println(F("Starting 'getPayloadLength'"));
 #endif
 	length = readRegister(REG_PAYLOAD_LENGTH_FSK);
+	length |= (readRegister(REG_PACKET_CONFIG2)&0x07)<<8;
 
 #if (SX1278FSK_debug_mode > 1)
 	Serial.print(F("## Payload length configured is "));
@@ -691,8 +880,9 @@ state = 0  --> The command has been executed with no errors
 Parameters:
 	wait: timeout in ms
 	data: memory where to place received data
+	lencb: callback for adjusting the payload length during reception (or NULL)
 */
-uint8_t SX1278FSK::receivePacketTimeout(uint32_t wait, byte *data)
+uint8_t SX1278FSK::receivePacketTimeout(uint32_t wait, byte *data, int (*lencb)(const byte *data, int len))
 {
 	int di=0;
 	uint8_t state = 2;
@@ -711,47 +901,77 @@ uint8_t SX1278FSK::receivePacketTimeout(uint32_t wait, byte *data)
 #endif
 	previous = millis();
 	/// FSK mode
-	value = readRegister(REG_IRQ_FLAGS2);
-	byte ready=0;
-	// while not yet done or FIFO not yet empty
-	while( (!ready || bitRead(value,6)==0) && (millis() - previous < wait) )
+	int len = getPayloadLength();
+	if(len<=0 || len>520) {
+		// TODO
+		Serial.println("TOO MUCH DATA");
+		len = 520;
+	}
+	rxquality.nbad = 0;
+	syncTime = 0;
+	int refrssi = -1;
+	uint32_t diowait = fifoWait(100);
+	// while not all data of the packet has been read
+	while( di<len && (millis() - previous < wait) )
 	{
-		if( bitRead(value,2)==1 ) ready=1;
-		if( bitRead(value, 6) == 0 ) { // FIFO not empty
-			data[di++] = readRegister(REG_FIFO);
-			// It's a bit of a hack.... get RSSI and AFC (a) at beginning of packet and
-			// for RS41 after about 0.5 sec. It might be more logical to put this decoder-specific
-			// code into RS41.cpp instead of this file... (maybe TODO?)
-			
-			if(di==1 || di==290 ) {
-				int rssi=getRSSI();
-				int afc=getAFC();
-				Serial.printf("Test(%d): RSSI=%d", rxtask.currentSonde, rssi/2);
-				Serial.print("Test: AFC="); Serial.println(afc);
-				sonde.sondeList[rxtask.currentSonde].rssi = rssi;
-				sonde.sondeList[rxtask.currentSonde].afc = afc;
-				if(rxtask.receiveResult==0xFFFF)
-					rxtask.receiveResult = RX_UPDATERSSI;
-				//sonde.si()->rssi = rssi;
-				//sonde.si()->afc = afc;
-			}
-			if(di>520) {
-				// TODO
-				Serial.println("TOO MUCH DATA");
-				break;
-			}
-			previous = millis(); // reset timeout after receiving data
+		value = getFifoFlags();
+		int n = 0;
+		if( bitRead(value, 2) ) n = len-di;	// PayloadReady: rest of packet is in FIFO
+		else if( bitRead(value, 5) ) n = SX1278_FIFO_BURST;	// FifoLevel: at least one burst available
+		if(n>len-di) n = len-di;
+		if( n==0 ) {
+			// DIO2 (SyncAddress) wakes us up right at the sync word
+			if( di==0 && syncTime==0 && (readRegister(REG_IRQ_FLAGS1)&0x01) ) syncTime = millis();
+			waitDIO(diowait);
+			continue;
+		}
+		if( syncTime==0 ) {
+			// no SyncAddress seen: sync word was about n bytes ago
+			syncTime = millis() - (uint32_t)(n * 8000 / getBitrate());
+		}
+		readFifo(data+di, n, value);
+		int di0 = di;
+		di += n;
+		if( bitRead(value, 4) ) {
+			// bytes have been lost before this burst, position of all further bytes unknown
+			markBad(di0, 0xFFFF);
 		} else {
-			delay(10);
+			// signal drop during this burst (RSSI value is -2*dBm), compared to the
+			// average of the preceding good bursts, so that slow fading is followed
+			int rssi = getRSSI();
+			if(refrssi<0) refrssi = rssi;
+			else if(rssi > refrssi + SX1278_RSSIDROP) markBad(di0, di);
+			else refrssi = (refrssi + rssi) / 2;
+		}
+		if(lencb) {
+			// chip stops at the new length, as long as it is not yet reached
+			int newlen = lencb(data, di);
+			if(newlen>=di && newlen<=520 && newlen!=len) {
+				setPayloadLength(newlen);
+				len = newlen;
+			}
 		}
-		value = readRegister(REG_IRQ_FLAGS2);
+		// It's a bit of a hack.... get RSSI and AFC (a) at beginning of packet and
+		// for RS41 after about 0.5 sec. It might be more logical to put this decoder-specific
+		// code into RS41.cpp instead of this file... (maybe TODO?)
+		if(di0==0 || (di0<290 && di>=290) ) {
+			int rssi=getRSSI();
+			int afc=getAFC();
+			Serial.printf("Test(%d): RSSI=%d", rxtask.currentSonde, rssi/2);
+			Serial.print("Test: AFC="); Serial.println(afc);
+			sonde.postRSSI(rssi, afc);
+		}
+		previous = millis(); // reset timeout after receiving data
 	}
-	if( !ready || bitRead(value, 6)==0) {
+	rxquality.len = len;
+	rxquality.received = di;
+	if( di<len ) {
+		markBad(di, len);
 #if 1&&(SX1278FSK_debug_mode > 0)
 		Serial.println(F("** The timeout has expired **"));
 		Serial.println();
 #endif
-		sonde.si()->rssi = getRSSI();
+		sonde.rxsi()->rssi = getRSSI();
 		writeRegister(REG_OP_MODE, FSK_STANDBY_MODE);	// Setting standby FSK mode
 		return 1;  // TIMEOUT
 	}
@@ -764,14 +984,57 @@ uint8_t SX1278FSK::receivePacketTimeout(uint32_t wait, byte *data)
 		Serial.print("|");
 	}
 	Serial.println(F(" ##"));
+	Serial.printf("FIFO: %d bursts, %d bytes, %d overruns, %d overruns avoided\n",
+		fifostat.bursts, fifostat.bytes, fifostat.overruns, fifostat.avoided);
 #endif
 	state = 0;
 	// Initializing flags	
 	clearIRQFlags();	
+	if(capture) captureFrame(data, di);
 
 	return state;
 }
 
+uint8_t SX1278FSK::startCapture(const char *filename)
+{
+	stopCapture();
+	capture = fopen(filename, "ab");
+	if(!capture) {
+		Serial.printf("Cannot open capture file %s\n", filename);
+		return 1;
+	}
+	Serial.printf("Capturing received data to %s\n", filename);
+	return 0;
+}
+
+void SX1278FSK::stopCapture()
+{
+	if(capture) fclose(capture);
+	capture = NULL;
+}
+
+void SX1278FSK::captureFrame(const uint8_t *data, int len)
+{
+	if(!capture) return;
+	SimRecord r;
+	r.len = len;
+	r.rssi = readRegister(REG_RSSI_VALUE_FSK);
+	r.afc = (readRegister(REG_AFC_MSB)<<8) | readRegister(REG_AFC_LSB);
+	// store configured sync word, so that SX1278Sim will only deliver
+	// the frame with a matching receiver configuration
+	uint8_t syncconf = readRegister(REG_SYNC_CONFIG);
+	r.synclen = (syncconf&0x10) ? (syncconf&0x07)+1 : 0;
+	for(int i=0; i<r.synclen; i++) {
+		r.sync[i] = readRegister(REG_SYNC_VALUE1+i);
+	}
+	if(simWriteRecord(capture, &r, data)!=0) {
+		Serial.println("Writing capture file failed");
+		stopCapture();
+		return;
+	}
+	fflush(capture);
+}
+
 
 #if 0
 /*
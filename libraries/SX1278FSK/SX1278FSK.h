@@ -18,6 +18,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <Arduino.h>
 #include <SPI.h>
 
@@ -162,6 +163,83 @@ const uint8_t FSK_TX_MODE = 0x03;
 const uint8_t FSK_RX_MODE = 0x05;
 
 
+/******************************************************************************
+ * SX1278Radio Class
+ * Register level access to a SX127x chip. SX1278SPIRadio talks to the real
+ * chip via SPI, SX1278Sim (see SX1278Sim.h) simulates the chip so that the
+ * RX path can be run without radio hardware.
+ ******************************************************************************/
+class SX1278Radio
+{
+public:
+	virtual ~SX1278Radio() {}
+
+	// Prepare the bus to the chip (SPI setup etc.)
+	virtual void begin() = 0;
+
+	// Release the bus
+	virtual void end() = 0;
+
+	virtual byte readRegister(byte address) = 0;
+	virtual void writeRegister(byte address, byte data) = 0;
+
+	// Read len bytes from the same register (i.e. FIFO) in one transaction
+	virtual void readBurst(byte address, byte *data, int len) {
+		for(int i=0; i<len; i++) data[i] = readRegister(address);
+	}
+
+	// Write len consecutive registers (address auto-increment) in one transaction
+	virtual void writeBurst(byte address, const byte *data, int len) {
+		for(int i=0; i<len; i++) writeRegister(address+i, data[i]);
+	}
+
+	// Call handler on each rising edge of DIO0/DIO1/DIO2 (NULL: detach)
+	// Returns true if DIO events will be delivered
+	virtual bool attachDIO(void (*handler)()) { return false; }
+};
+
+class SX1278SPIRadio : public SX1278Radio
+{
+public:
+	void begin();
+	void end();
+	byte readRegister(byte address);
+	void writeRegister(byte address, byte data);
+	void readBurst(byte address, byte *data, int len);
+	void writeBurst(byte address, const byte *data, int len);
+	bool attachDIO(void (*handler)());
+
+	int dio[3];		// GPIO connected to DIO0..DIO2, -1 if not connected
+};
+
+// Poll interval if no DIO interrupts are available
+#define SX1278_POLL_MS 10
+
+// FIFO is read in bursts of this size (FifoLevel threshold is SX1278_FIFO_BURST-1)
+#define SX1278_FIFO_BURST 32
+#define SX1278_FIFO_SIZE 64
+
+// Quality of the last packet received by receivePacketTimeout: ranges of
+// unreliable bytes (weak signal, data lost by FIFO overrun, missing at end of
+// a truncated packet), can be used as erasures by the decoder
+#define SX1278_MAXBAD 8
+#define SX1278_RSSIDROP 12	// RSSI drop (in 0.5dB) below the preceding good bursts that marks a burst as unreliable
+typedef struct st_rxquality {
+	int len;		// expected packet length
+	int received;		// bytes actually received
+	int nbad;
+	uint16_t badfrom[SX1278_MAXBAD];	// unreliable bytes: [badfrom, badto)
+	uint16_t badto[SX1278_MAXBAD];
+} RXQuality;
+
+// FIFO statistics
+typedef struct st_fifostat {
+	uint32_t bursts;	// number of burst reads
+	uint32_t bytes;		// bytes read from FIFO
+	uint32_t overruns;	// FIFO overruns (data lost)
+	uint32_t avoided;	// bursts that drained a full FIFO just before an overrun
+} FifoStat;
+
 /******************************************************************************
  * SX1278FSK Class
  * Functions and variables for managing SX127x transceiver chips in FSK mode,
@@ -173,6 +251,10 @@ public:
 	// class constructor
    	SX1278FSK();
    	
+	// Select the register access backend (default: SPI)
+	void setRadio(SX1278Radio *r);
+	SX1278Radio *getRadio();
+
 	// Turn on SX1278 module (return 0 on sucess, 1 otherwise)
 	uint8_t ON();
 
@@ -188,6 +270,31 @@ public:
 	// Clear IRQ flags
 	void clearIRQFlags();
 
+	// Read REG_IRQ_FLAGS2, counting (and clearing) FIFO overruns
+	byte getFifoFlags();
+
+	// Read len bytes from FIFO in one burst (bytes must be available)
+	// flags: value of getFifoFlags() before the burst
+	void readFifo(byte *data, int len, byte flags);
+
+	FifoStat fifostat;
+	RXQuality rxquality;
+	// millis() timestamp of the sync word of the last packet seen by
+	// receivePacketTimeout (also if incomplete), 0 if there was none
+	uint32_t syncTime;
+
+	// GPIO pins connected to DIO0 (PayloadReady), DIO1 (FifoLevel), DIO2 (SyncAddress)
+	// of the SPI radio, -1 if not connected
+	void setDIOPins(int dio0, int dio1, int dio2);
+
+	// Sleep until a DIO event (or at most ms milliseconds). Without DIO interrupts,
+	// this just waits for SX1278_POLL_MS
+	void waitDIO(uint32_t ms);
+
+	// Timeout for waitDIO() while waiting for FIFO data: ms, or less if the FIFO
+	// could overrun before a DIO event (FifoLevel on DIO1 not connected)
+	uint32_t fifoWait(uint32_t ms);
+
 	// Activate FSK mode (return 0 on success, 1 otherwise)
 	uint8_t setFSK();
 
@@ -206,6 +313,12 @@ public:
 	// Configures RX frequency (closest approximation to requested frequency)
  	uint8_t setFrequency(float freq);
  	float getFrequency();
+	// Write FRF register value (MSB/MID/LSB in one SPI transaction; with FastHop
+	// enabled, the hop is triggered by the last byte)
+	void setFrf(uint32_t frf);
+	// Change frequency without leaving RX mode (FastHop) and restart the receiver.
+	// Much faster than setFrequency() + decoder setup, the modem configuration is kept.
+	uint8_t fastHop(float freq);
 	
 	int getLNAGain();
 	uint8_t setLNAGain(int gain);
@@ -251,8 +364,18 @@ public:
 	//return '0' on success, '1' otherwise
 	uint8_t receive();
 
-	// Receive a packet
-        uint8_t receivePacketTimeout(uint32_t wait, byte *data);
+	// Receive a packet (rxquality is updated, also if the packet is incomplete)
+	// lencb (optional) is called after each FIFO read with the data received so far,
+	// and returns a new payload length (e.g. after decoding a frame type byte) or 0
+        uint8_t receivePacketTimeout(uint32_t wait, byte *data, int (*lencb)(const byte *data, int len) = NULL);
+
+	// Record received data to a replay file for SX1278Sim (see SX1278Sim.h)
+	// (return 0 on success, 1 otherwise)
+	uint8_t startCapture(const char *filename);
+	void stopCapture();
+	// Called with each received packet (or chunk of continuous data)
+	void captureFrame(const uint8_t *data, int len);
+	bool isCapturing() { return capture!=NULL; }
 
 
 
@@ -271,6 +394,12 @@ public:
 	void showRxRegisters();	
 #endif
 
+private:
+	SX1278Radio *radio;
+	FILE *capture;
+	bool diomode;		// DIO events are delivered by radio
+	bool fifodio;		// ... including FifoLevel (DIO1)
+	void markBad(int from, int to);
 };
 
 extern SX1278FSK	sx1278;
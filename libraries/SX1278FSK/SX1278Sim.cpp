@@ -0,0 +1,374 @@
+/*
+ * Register level simulation of a SX127x chip in FSK mode
+ *
+ *  SPDX-License-Identifier:	LGPL-2.1+
+ */
+
+#include "SX1278Sim.h"
+
+#define SIM_DEBUG 0
+
+#define SIM_RSSI_NOISE 0xF0	// -120 dBm
+
+SX1278Sim::SX1278Sim()
+{
+	fp = NULL;
+	loop = true;
+	speedup = 1;
+	interval = 1000;
+	frames = bytes = overruns = 0;
+	memset(reg, 0, sizeof(reg));
+	fifohead = fifocount = 0;
+	framelen = framepos = payloadpos = 0;
+	framevalid = false;
+	inpacket = false;
+	framestart = 0;
+	rxsince = 0;
+	simnow = 0;
+	clockrunning = false;
+	diohandler = NULL;
+	diolevel = 0;
+	simtask = NULL;
+	lock = NULL;
+}
+
+void SX1278Sim::begin()
+{
+	// power on defaults of the registers used by SX1278FSK
+	memset(reg, 0, sizeof(reg));
+	reg[REG_OP_MODE] = FSK_STANDBY_MODE;
+	reg[REG_BITRATE_MSB] = 0x1A;
+	reg[REG_BITRATE_LSB] = 0x0B;
+	reg[REG_RSSI_VALUE_FSK] = SIM_RSSI_NOISE;
+	reg[REG_PACKET_CONFIG1] = 0x90;
+	reg[REG_PACKET_CONFIG2] = 0x40;
+	reg[REG_PAYLOAD_LENGTH_FSK] = 0x40;
+	reg[REG_FIFO_THRESH] = 0x0F;
+	reg[REG_IRQ_FLAGS2] = 0x40;
+	reg[REG_VERSION] = 0x12;
+	fifohead = fifocount = 0;
+}
+
+void SX1278Sim::end()
+{
+}
+
+int SX1278Sim::open(const char *filename)
+{
+	close();
+	fp = fopen(filename, "rb");
+	if(!fp) {
+		Serial.printf("SX1278Sim: cannot open %s\n", filename);
+		return 1;
+	}
+	frames = bytes = overruns = 0;
+	framevalid = false;
+	clockrunning = false;
+	simnow = 0;
+	framestart = simTime();
+	return 0;
+}
+
+void SX1278Sim::close()
+{
+	if(fp) fclose(fp);
+	fp = NULL;
+	framevalid = false;
+}
+
+void SX1278Sim::setSpeedup(int factor)
+{
+	if(factor<1) factor=1;
+	speedup = factor;
+}
+
+void SX1278Sim::setFrameInterval(uint32_t ms)
+{
+	interval = ms;
+}
+
+void SX1278Sim::setLoop(bool l)
+{
+	loop = l;
+}
+
+// simulated time in us since open()
+uint64_t SX1278Sim::simTime()
+{
+	uint32_t now = micros();
+	if(!clockrunning) { lastmicros = now; clockrunning = true; }
+	simnow += (uint64_t)(uint32_t)(now - lastmicros) * speedup;
+	lastmicros = now;
+	return simnow;
+}
+
+// air time of one FIFO byte in us
+uint32_t SX1278Sim::byteTime()
+{
+	uint32_t br = (reg[REG_BITRATE_MSB]<<8) | reg[REG_BITRATE_LSB];
+	if(br==0) br = 1;
+	// with Manchester decoding, each byte in the FIFO requires 16 bits on air
+	int bits = ((reg[REG_PACKET_CONFIG1]>>5)&0x03)==1 ? 16 : 8;
+	return (uint64_t)bits * 1000000 * br / SX127X_CRYSTAL_FREQ;
+}
+
+int SX1278Sim::payloadLength()
+{
+	return ((reg[REG_PACKET_CONFIG2]&0x07)<<8) | reg[REG_PAYLOAD_LENGTH_FSK];
+}
+
+int simReadRecord(FILE *fp, SimRecord *r, uint8_t *data, int maxlen)
+{
+	uint8_t hdr[6];
+	if(fread(hdr, 1, 6, fp)!=6) return 1;
+	r->len = hdr[0] | (hdr[1]<<8);
+	r->rssi = hdr[2];
+	r->afc = (int16_t)(hdr[3] | (hdr[4]<<8));
+	r->synclen = hdr[5];
+	if(r->len>maxlen || r->synclen>8) {
+		Serial.printf("SX1278Sim: invalid frame record (len=%d)\n", r->len);
+		return 1;
+	}
+	if(fread(r->sync, 1, r->synclen, fp)!=r->synclen) return 1;
+	if(fread(data, 1, r->len, fp)!=r->len) return 1;
+	return 0;
+}
+
+int simWriteRecord(FILE *fp, const SimRecord *r, const uint8_t *data)
+{
+	uint8_t hdr[6];
+	hdr[0] = r->len&0xFF;
+	hdr[1] = r->len>>8;
+	hdr[2] = r->rssi;
+	hdr[3] = r->afc&0xFF;
+	hdr[4] = (r->afc>>8)&0xFF;
+	hdr[5] = r->synclen;
+	if(fwrite(hdr, 1, 6, fp)!=6) return 1;
+	if(fwrite(r->sync, 1, r->synclen, fp)!=r->synclen) return 1;
+	if(fwrite(data, 1, r->len, fp)!=r->len) return 1;
+	return 0;
+}
+
+bool SX1278Sim::readFrame()
+{
+	if(!fp) return false;
+	for(int attempt=0; attempt<2; attempt++) {
+		if(simReadRecord(fp, &rec, frame, SIM_MAXFRAME)==0) {
+			framelen = rec.len;
+			reg[REG_RSSI_VALUE_FSK] = rec.rssi;
+			reg[REG_AFC_LSB] = rec.afc&0xFF;
+			reg[REG_AFC_MSB] = (rec.afc>>8)&0xFF;
+			return true;
+		}
+		if(!loop || feof(fp)==0) return false;
+		rewind(fp);
+	}
+	return false;
+}
+
+bool SX1278Sim::syncMatch()
+{
+	if(rec.synclen==0) return true;
+	uint8_t conf = reg[REG_SYNC_CONFIG];
+	if( (conf&0x10)==0 ) return true;	// sync detection off
+	int n = (conf&0x07) + 1;
+	if(n>rec.synclen) return false;
+	// compare configured sync word with the last n bytes of the frame's sync
+	for(int i=0; i<n; i++) {
+		if(reg[REG_SYNC_VALUE1+i] != rec.sync[rec.synclen-n+i]) return false;
+	}
+	return true;
+}
+
+void SX1278Sim::fifoPush(uint8_t b)
+{
+	if(fifocount>=SIM_FIFOSIZE) {
+		reg[REG_IRQ_FLAGS2] |= 0x10;	// FifoOverrun
+		overruns++;
+		return;
+	}
+	fifo[(fifohead+fifocount)%SIM_FIFOSIZE] = b;
+	fifocount++;
+	bytes++;
+}
+
+// Advance simulation to current (simulated) time
+void SX1278Sim::update()
+{
+	uint64_t now = simTime();
+	bool rx = (reg[REG_OP_MODE]&0x07)==FSK_RX_MODE;
+	uint32_t bt = byteTime();
+
+	while(1) {
+		if(!framevalid) {
+			if(!readFrame()) return;
+			framevalid = true;
+			framepos = 0;
+			inpacket = false;
+		}
+		if(now < framestart) return;
+		if(!inpacket) {
+			// sync word is on air just before framestart, can only be
+			// detected if receiver was active at that time
+			if(rx && rxsince <= framestart && syncMatch()) {
+				inpacket = true;
+				payloadpos = 0;
+				frames++;
+				reg[REG_IRQ_FLAGS1] |= 0x01;	// SyncAddressMatch
+#if SIM_DEBUG
+				Serial.printf("SX1278Sim: frame %d (%d bytes)\n", frames, framelen);
+#endif
+			} else if(now >= framestart + (uint64_t)framelen*bt) {
+				// frame is over, we missed it
+				framevalid = false;
+				framestart += (uint64_t)interval*1000;
+				reg[REG_RSSI_VALUE_FSK] = SIM_RSSI_NOISE;
+				continue;
+			} else {
+				return;
+			}
+		}
+		// push all bytes that have been received until now
+		int plen = payloadLength();
+		while(framepos<framelen && framestart + (uint64_t)framepos*bt <= now) {
+			if(!rx) break;
+			fifoPush(frame[framepos++]);
+			payloadpos++;
+			if(plen>0 && payloadpos>=plen) {
+				reg[REG_IRQ_FLAGS2] |= 0x04;	// PayloadReady
+				framepos = framelen;	// rest of frame not received
+			}
+		}
+		if(framepos<framelen) return;
+		// frame done
+		framevalid = false;
+		inpacket = false;
+		if(plen==0) {
+			// unlimited length: next frame directly follows this one
+			framestart += (uint64_t)framelen*bt;
+		} else {
+			framestart += (uint64_t)interval*1000;
+			reg[REG_RSSI_VALUE_FSK] = SIM_RSSI_NOISE;
+		}
+	}
+}
+
+// Track DIO levels and report rising edges to the handler
+void SX1278Sim::updateDIO()
+{
+	uint8_t map = reg[REG_DIO_MAPPING1];
+	uint8_t level = 0;
+	if( ((map>>6)&3)==0 && (reg[REG_IRQ_FLAGS2]&0x04) ) level |= 1;	// PayloadReady
+	if( ((map>>4)&3)==0 && fifocount>(reg[REG_FIFO_THRESH]&0x3F) ) level |= 2;	// FifoLevel
+	if( ((map>>2)&3)==3 && (reg[REG_IRQ_FLAGS1]&0x01) ) level |= 4;	// SyncAddress
+	uint8_t rising = level & ~diolevel;
+	diolevel = level;
+	if(rising && diohandler) diohandler();
+}
+
+void SX1278Sim::simTask(void *param)
+{
+	SX1278Sim *sim = (SX1278Sim *)param;
+	while(sim->diohandler) {
+		xSemaphoreTake(sim->lock, portMAX_DELAY);
+		sim->update();
+		sim->updateDIO();
+		xSemaphoreGive(sim->lock);
+		vTaskDelay(1);
+	}
+	sim->simtask = NULL;
+	vTaskDelete(NULL);
+}
+
+bool SX1278Sim::attachDIO(void (*handler)())
+{
+	if(!lock) lock = xSemaphoreCreateMutex();
+	diohandler = handler;
+	if(handler && !simtask) {
+		xTaskCreate(simTask, "sx1278Sim", 4096, this, 2, &simtask);
+	}
+	return handler!=NULL;
+}
+
+byte SX1278Sim::readRegister(byte address)
+{
+	if(lock) xSemaphoreTake(lock, portMAX_DELAY);
+	byte value = readReg(address);
+	updateDIO();
+	if(lock) xSemaphoreGive(lock);
+	return value;
+}
+
+void SX1278Sim::writeRegister(byte address, byte data)
+{
+	if(lock) xSemaphoreTake(lock, portMAX_DELAY);
+	writeReg(address, data);
+	updateDIO();
+	if(lock) xSemaphoreGive(lock);
+}
+
+byte SX1278Sim::readReg(byte address)
+{
+	address &= 0x7F;
+	update();
+	switch(address) {
+	case REG_FIFO:
+		{
+		if(fifocount==0) return 0;
+		byte b = fifo[fifohead];
+		fifohead = (fifohead+1)%SIM_FIFOSIZE;
+		fifocount--;
+		if(fifocount==0) reg[REG_IRQ_FLAGS2] &= ~0x04;
+		return b;
+		}
+	case REG_IRQ_FLAGS2:
+		{
+		byte v = reg[REG_IRQ_FLAGS2] & 0x14;
+		if(fifocount>=SIM_FIFOSIZE) v |= 0x80;	// FifoFull
+		if(fifocount==0) v |= 0x40;		// FifoEmpty
+		if(fifocount>(reg[REG_FIFO_THRESH]&0x3F)) v |= 0x20;	// FifoLevel
+		return v;
+		}
+	case REG_IRQ_FLAGS1:
+		{
+		byte v = reg[REG_IRQ_FLAGS1] | 0x80;	// ModeReady
+		if((reg[REG_OP_MODE]&0x07)==FSK_RX_MODE) v |= 0x40;	// RxReady
+		return v;
+		}
+	}
+	return reg[address];
+}
+
+void SX1278Sim::writeReg(byte address, byte data)
+{
+	address &= 0x7F;
+	update();
+	switch(address) {
+	case REG_FIFO:
+		return;		// TX not supported
+	case REG_OP_MODE:
+		if((data&0x07)==FSK_RX_MODE && (reg[REG_OP_MODE]&0x07)!=FSK_RX_MODE) {
+			// (re)start receiver with empty FIFO
+			fifohead = fifocount = 0;
+			reg[REG_IRQ_FLAGS2] &= ~0x14;
+			reg[REG_IRQ_FLAGS1] &= ~0x01;
+			inpacket = false;
+			rxsince = simTime();
+		}
+		reg[REG_OP_MODE] = data;
+		return;
+	case REG_IRQ_FLAGS1:
+		reg[REG_IRQ_FLAGS1] &= ~(data&0x0B);
+		return;
+	case REG_IRQ_FLAGS2:
+		if(data&0x10) {
+			// clearing FifoOverrun also clears the FIFO
+			reg[REG_IRQ_FLAGS2] &= ~0x10;
+			fifohead = fifocount = 0;
+		}
+		return;
+	case REG_VERSION:
+		return;
+	}
+	reg[address] = data;
+}
@@ -0,0 +1,122 @@
+/*
+ * Register level simulation of a SX127x chip in FSK mode
+ *
+ * Replays recorded frames from a file through the FIFO, with the timing
+ * of the configured bit rate (optionally sped up), so that the complete
+ * RX path (SX1278FSK, decoders) can be run and profiled without radio.
+ * It runs on the ESP32 only (Arduino Serial/micros(), FreeRTOS task and
+ * mutex), replay files are read from SPIFFS; there is no host build.
+ *
+ *  SPDX-License-Identifier:	LGPL-2.1+
+ */
+
+#ifndef SX1278Sim_h
+#define SX1278Sim_h
+
+#include <stdio.h>
+#include "SX1278FSK.h"
+
+/*
+ * Replay file format: sequence of frame records, each consisting of
+ *   uint16_t len       (little endian) number of payload bytes
+ *   uint8_t  rssi      value of REG_RSSI_VALUE_FSK while receiving (-dBm*2)
+ *   int16_t  afc       value of REG_AFC_MSB/LSB (little endian)
+ *   uint8_t  synclen   number of sync bytes (0..8)
+ *   uint8_t  sync[synclen]   sync word preceding the frame
+ *   uint8_t  data[len] payload, as read from the FIFO after sync detection
+ * Frames are only delivered if the sync word matches the configured one
+ * (synclen 0 always matches).
+ *
+ * If a DIO handler is attached, a background task advances the simulation
+ * and calls the handler on rising edges of DIO0..DIO2 according to
+ * REG_DIO_MAPPING1 (PayloadReady, FifoLevel, SyncAddress), like the GPIO
+ * interrupts of the real radio.
+ */
+#define SIM_MAXFRAME 1024
+#define SIM_FIFOSIZE 64
+
+typedef struct st_simrecord {
+	uint16_t len;
+	uint8_t rssi;
+	int16_t afc;
+	uint8_t synclen;
+	uint8_t sync[8];
+} SimRecord;
+
+// Read one frame record (header into r, payload into data, at most maxlen bytes)
+// Returns 0 on success, 1 on end of file or invalid record
+int simReadRecord(FILE *fp, SimRecord *r, uint8_t *data, int maxlen);
+// Append one frame record, returns 0 on success
+int simWriteRecord(FILE *fp, const SimRecord *r, const uint8_t *data);
+
+class SX1278Sim : public SX1278Radio
+{
+public:
+	SX1278Sim();
+
+	void begin();
+	void end();
+	byte readRegister(byte address);
+	void writeRegister(byte address, byte data);
+	bool attachDIO(void (*handler)());
+
+	// Open replay file (return 0 on success, 1 otherwise)
+	int open(const char *filename);
+	void close();
+
+	// Simulated time runs <factor> times faster than real time
+	void setSpeedup(int factor);
+	// Start of one frame to start of next frame (simulated ms), default 1000
+	void setFrameInterval(uint32_t ms);
+	// Restart at beginning of the file at end of file
+	void setLoop(bool loop);
+
+	// statistics
+	uint32_t frames;	// frames delivered (sync matched)
+	uint32_t bytes;		// bytes pushed into FIFO
+	uint32_t overruns;	// bytes lost due to FIFO overrun
+
+private:
+	uint8_t reg[0x80];
+	uint8_t fifo[SIM_FIFOSIZE];
+	int fifohead, fifocount;
+
+	FILE *fp;
+	bool loop;
+	int speedup;
+	uint32_t interval;
+
+	// currently transmitted frame
+	SimRecord rec;
+	uint8_t frame[SIM_MAXFRAME];
+	int framelen;
+	int framepos;		// next byte to push into FIFO
+	int payloadpos;		// bytes delivered in current packet
+	bool framevalid;
+	bool inpacket;
+	uint64_t framestart;	// simulated time of first payload byte (us)
+	uint64_t rxsince;	// simulated time of entering RX mode
+
+	uint64_t simnow;
+	uint32_t lastmicros;
+	bool clockrunning;
+
+	void (*diohandler)();
+	uint8_t diolevel;	// bit i: current level of DIOi
+	TaskHandle_t simtask;
+	SemaphoreHandle_t lock;
+	static void simTask(void *param);
+	void updateDIO();
+	byte readReg(byte address);
+	void writeReg(byte address, byte data);
+
+	uint64_t simTime();
+	uint32_t byteTime();
+	int payloadLength();
+	bool readFrame();
+	bool syncMatch();
+	void fifoPush(uint8_t b);
+	void update();
+};
+
+#endif
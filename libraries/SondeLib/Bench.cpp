@@ -0,0 +1,331 @@
+/* Decoder throughput benchmark */
+#include "Bench.h"
+#include "SX1278FSK.h"
+#include "SX1278Sim.h"
+#include "Sonde.h"
+#include "RS41.h"
+#include "RS92.h"
+#include "DFM.h"
+#include "rs92gps.h"
+#include "rsc.h"
+
+// CPU clock for converting time to cycles
+#ifdef F_CPU
+#define BENCH_MHZ (F_CPU/1000000)
+#else
+#define BENCH_MHZ 240
+#endif
+
+const char *benchVariantStr[BV_MAX] = { "clean", "biterr", "burst", "fade", "trunc" };
+
+// radio backend used while running the benchmark (setup() of the decoders
+// is called to initialize their tables, this must not touch the real radio)
+static SX1278Sim benchsim;
+
+typedef struct st_corpus {
+	int n;
+	SimRecord rec[BENCH_MAXFRAMES];
+	uint8_t *data[BENCH_MAXFRAMES];
+} Corpus;
+
+// deterministic pseudo random numbers, so that runs are comparable
+static uint32_t benchrand;
+static uint32_t xorshift() {
+	benchrand ^= benchrand<<13;
+	benchrand ^= benchrand>>17;
+	benchrand ^= benchrand<<5;
+	return benchrand;
+}
+
+static void freeCorpus(Corpus *c) {
+	for(int i=0; i<c->n; i++) free(c->data[i]);
+	c->n = 0;
+}
+
+static int loadCorpus(const char *prefix, const char *name, Corpus *c, int maxlen) {
+	char fn[64];
+	uint8_t buf[SIM_MAXFRAME];
+	snprintf(fn, 64, "%s%s", prefix, name);
+	c->n = 0;
+	FILE *fp = fopen(fn, "rb");
+	if(!fp) {
+		Serial.printf("Bench: no corpus %s\n", fn);
+		return 1;
+	}
+	while(c->n<BENCH_MAXFRAMES && simReadRecord(fp, c->rec+c->n, buf, SIM_MAXFRAME)==0) {
+		if(c->rec[c->n].len==0 || c->rec[c->n].len>maxlen) continue;
+		c->data[c->n] = (uint8_t *)malloc(c->rec[c->n].len);
+		if(!c->data[c->n]) break;
+		memcpy(c->data[c->n], buf, c->rec[c->n].len);
+		c->n++;
+	}
+	fclose(fp);
+	Serial.printf("Bench: %d frames from %s\n", c->n, fn);
+	return c->n==0;
+}
+
+// Copy recorded frame, applying transmission errors according to variant
+// q (optional) receives the range of destroyed bytes, if known to the receiver
+static void makeVariant(int variant, const uint8_t *src, uint8_t *dst, int len, RXQuality *q = NULL) {
+	memcpy(dst, src, len);
+	int from = 0, to = 0;
+	switch(variant) {
+	case BV_BITERR:	// 8 single bit errors
+		for(int i=0; i<8; i++) {
+			dst[xorshift()%len] ^= 1<<(xorshift()&7);
+		}
+		break;
+	case BV_BURST:	// 10 consecutive bytes destroyed
+		{
+		int p = xorshift()%len;
+		for(int i=p; i<p+10 && i<len; i++) dst[i] ^= 1+xorshift()%255;
+		}
+		break;
+	case BV_FADE:	// signal lost for 40 bytes
+		from = xorshift()%len;
+		to = from+40 < len ? from+40 : len;
+		for(int i=from; i<to; i++) dst[i] ^= 1+xorshift()%255;
+		break;
+	case BV_TRUNC:	// reception ends before the last 1/8 of the frame
+		from = len-len/8;
+		to = len;
+		memset(dst+from, 0, to-from);
+		break;
+	}
+	if(q) {
+		q->len = len;
+		q->received = variant==BV_TRUNC ? from : len;
+		q->nbad = to>from ? 1 : 0;
+		q->badfrom[0] = from;
+		q->badto[0] = to;
+	}
+}
+
+static void initResult(BenchResult *r, const char *s0, const char *s1, const char *s2) {
+	memset(r, 0, sizeof(BenchResult));
+	r->stage[0].name = s0;
+	r->stage[1].name = s1;
+	r->stage[2].name = s2;
+}
+
+static void countResult(BenchResult *r, int corr, int ok) {
+	r->frames++;
+	if(corr<0) r->failed++;
+	else if(corr>0) { r->corrected++; r->corrections += corr; }
+	if(ok) r->ok++;
+}
+
+static void printResult(const char *decoder, int variant, BenchResult *r) {
+	for(int i=0; i<3; i++) r->us += r->stage[i].us;
+	if(r->frames==0) return;
+	Serial.printf("Bench %-9s %-6s: %d frames, %d frames/s, ok %d, corrected %d (%d), failed %d\n",
+		decoder, benchVariantStr[variant], r->frames, r->us ? (int)((uint64_t)r->frames*1000000/r->us) : -1,
+		r->ok, r->corrected, r->corrections, r->failed);
+	for(int i=0; i<3; i++) {
+		if(!r->stage[i].name) continue;
+		Serial.printf("    %-12s %8d ns/frame %9d cycles/frame\n", r->stage[i].name,
+			(int)((uint64_t)r->stage[i].us*1000/r->frames),
+			(int)((uint64_t)r->stage[i].us*BENCH_MHZ/r->frames));
+	}
+}
+
+#define RS41BUFLEN 520
+static void benchRS41(const char *prefix) {
+	Corpus c;
+	int corr[BENCH_MAXFRAMES], crc[BENCH_MAXFRAMES], refcorr[BENCH_MAXFRAMES];
+	if(loadCorpus(prefix, "rs41.rec", &c, RS41BUFLEN-8)) return;
+	uint8_t *work = (uint8_t *)malloc(c.n*RS41BUFLEN);
+	// output of the table driven RS decoder (first round), to check the reference against;
+	// bytes of uncorrectable frames are not compared
+	uint8_t *ref = (uint8_t *)malloc(c.n*RS41BUFLEN);
+	RXQuality *q = (RXQuality *)malloc(c.n*sizeof(RXQuality));
+	if(!work || !ref || !q) { free(work); free(ref); free(q); freeCorpus(&c); return; }
+	rs41.setup(402000000);
+	for(int v=0; v<BV_MAX; v++) {
+	// variants with known bad bytes: compare decoding without and with erasures
+	for(int eras=0; eras<=(v==BV_FADE||v==BV_TRUNC); eras++) {
+	// table driven RS decoder and MODNN reference, results must agree
+	for(int packed=1; packed>=0; packed--) {
+		rsc_use_packed = packed;
+		BenchResult r;
+		initResult(&r, "descramble", "reedsolomon", NULL);
+		int mismatch = 0;
+		benchrand = 0x12345678;
+		for(int round=0; round<BENCH_ROUNDS; round++) {
+			for(int i=0; i<c.n; i++) {
+				memset(work+i*RS41BUFLEN, 0, 8);
+				makeVariant(v, c.data[i], work+i*RS41BUFLEN+8, c.rec[i].len, q+i);
+			}
+			uint32_t t = micros();
+			for(int i=0; i<c.n; i++) rs41.descramble(work+i*RS41BUFLEN, c.rec[i].len+8);
+			r.stage[0].us += micros()-t;
+			t = micros();
+			for(int i=0; i<c.n; i++) corr[i] = rs41.correct41(work+i*RS41BUFLEN, eras ? q+i : NULL);
+			r.stage[1].us += micros()-t;
+			if(round==0) {
+				for(int i=0; i<c.n; i++) {
+					uint8_t *f = work+i*RS41BUFLEN;
+					if(packed) {
+						memcpy(ref+i*RS41BUFLEN, f, c.rec[i].len+8);
+						refcorr[i] = corr[i];
+					} else if(corr[i]!=refcorr[i] ||
+						(corr[i]>=0 && memcmp(ref+i*RS41BUFLEN, f, c.rec[i].len+8)!=0)) {
+						if(mismatch==0) Serial.printf("RS41/ref: frame %d differs from table driven decoder (corr %d vs %d)\n",
+							i, corr[i], refcorr[i]);
+						mismatch++;
+					}
+				}
+			}
+			// CRC check and output of the fields, not timed
+			for(int i=0; i<c.n; i++) crc[i] = rs41.parse41(work+i*RS41BUFLEN, c.rec[i].len+8);
+			for(int i=0; i<c.n; i++) countResult(&r, corr[i], crc[i]==0);
+		}
+		printResult(packed ? (eras ? "RS41+eras" : "RS41") : (eras ? "RS41/ref+e" : "RS41/ref"), v, &r);
+		if(!packed) Serial.printf("    %d of %d frames differ from table driven decoder\n", mismatch, c.n);
+	}
+	}
+	}
+	rsc_use_packed = 1;
+	free(q);
+	free(ref);
+	free(work);
+	freeCorpus(&c);
+}
+
+#define DFMLEN 33
+static void benchDFM(const char *prefix) {
+	Corpus c;
+	int corr[BENCH_MAXFRAMES], refcorr[BENCH_MAXFRAMES];
+	if(loadCorpus(prefix, "dfm.rec", &c, DFMLEN)) return;
+	uint8_t *work = (uint8_t *)malloc(c.n*DFMLEN);
+	// output of the table driven decoder (first round), to check the reference against;
+	// bytes of uncorrectable frames are not compared
+	uint8_t *ref = (uint8_t *)malloc(c.n*DFM_FRAMEBYTES);
+	if(!work || !ref) { free(work); free(ref); freeCorpus(&c); return; }
+	// recorded sync word tells if sonde was received with inverted polarity
+	dfm.setup(403000000, c.rec[0].synclen>0 && c.rec[0].sync[0]==0x9A);
+	for(int v=0; v<BV_MAX; v++) {
+		// table driven decoder and bit by bit reference, results must agree
+		for(int packed=1; packed>=0; packed--) {
+			dfm.use_packed = packed;
+			BenchResult r;
+			initResult(&r, "hamming", NULL, NULL);
+			int mismatch = 0;
+			benchrand = 0x12345678;
+			for(int round=0; round<BENCH_ROUNDS; round++) {
+				for(int i=0; i<c.n; i++) {
+					memset(work+i*DFMLEN, 0, DFMLEN);
+					makeVariant(v, c.data[i], work+i*DFMLEN, c.rec[i].len);
+				}
+				// getFrame returns the last corrected frame only, so frames
+				// are timed one by one (decodeFrame only prints, not timed)
+				for(int i=0; i<c.n; i++) {
+					uint32_t t0 = micros();
+					corr[i] = dfm.correctFrame(work+i*DFMLEN);
+					r.stage[0].us += micros()-t0;
+					if(round>0) continue;
+					uint8_t out[DFM_FRAMEBYTES];
+					dfm.getFrame(out);
+					if(packed) {
+						memcpy(ref+i*DFM_FRAMEBYTES, out, DFM_FRAMEBYTES);
+						refcorr[i] = corr[i];
+					} else if(corr[i]!=refcorr[i] ||
+						(corr[i]>=0 && memcmp(ref+i*DFM_FRAMEBYTES, out, DFM_FRAMEBYTES)!=0)) {
+						if(mismatch==0) Serial.printf("DFM/bits: frame %d differs from table driven decoder (corr %d vs %d)\n",
+							i, corr[i], refcorr[i]);
+						mismatch++;
+					}
+				}
+				for(int i=0; i<c.n; i++) countResult(&r, corr[i], corr[i]>=0);
+			}
+			printResult(packed ? "DFM" : "DFM/bits", v, &r);
+			if(!packed) Serial.printf("    %d of %d frames differ from table driven decoder\n", mismatch, c.n);
+		}
+	}
+	dfm.use_packed = 1;
+	free(ref);
+	free(work);
+	freeCorpus(&c);
+}
+
+#define RS92FRAMELEN 240
+static void benchRS92(const char *prefix) {
+	Corpus c;
+	if(loadCorpus(prefix, "rs92.rec", &c, SIM_MAXFRAME)) return;
+	int total = 0;
+	for(int i=0; i<c.n; i++) total += c.rec[i].len;
+	uint8_t *stream = (uint8_t *)malloc(total);
+	uint8_t *frames = (uint8_t *)malloc(BENCH_MAXFRAMES*RS92FRAMELEN);
+	int corr[BENCH_MAXFRAMES];
+	if(!stream || !frames) { free(stream); free(frames); freeCorpus(&c); return; }
+	rs92.setup(402000000);
+	for(int v=0; v<BV_MAX; v++) {
+		BenchResult r;
+		initResult(&r, "8N1+RS", "gps", "gps/comb");
+		double dsum = 0, dmax = 0;
+		int nd = 0;
+		benchrand = 0x12345678;
+		for(int round=0; round<BENCH_ROUNDS; round++) {
+			int pos = 0;
+			for(int i=0; i<c.n; i++) {
+				makeVariant(v, c.data[i], stream+pos, c.rec[i].len);
+				pos += c.rec[i].len;
+			}
+			// feed data in chunks of FIFO size, as the RX task would do
+			int nf = 0;
+			uint32_t t = micros();
+			for(pos=0; pos<total; pos+=64) {
+				rs92.processData(stream+pos, total-pos<64 ? total-pos : 64);
+				int fc;
+				uint8_t *f = rs92.newFrame(&fc);
+				if(!f) continue;
+				if(nf<BENCH_MAXFRAMES) {
+					memcpy(frames+nf*RS92FRAMELEN, f, RS92FRAMELEN);
+					corr[nf++] = fc;
+				}
+				rs92.releaseFrame(f);
+			}
+			r.stage[0].us += micros()-t;
+			// least squares solver, and brute force 4 satellite search as reference
+			// (gps_us: position solution only, without the output of print_frame)
+			double fix[BENCH_MAXFRAMES][3];
+			for(int i=0; i<nf; i++) {
+				gps_us = 0;
+				print_frame(frames+i*RS92FRAMELEN, RS92FRAMELEN);
+				r.stage[1].us += gps_us;
+				fix[i][0] = gpx.lat; fix[i][1] = gpx.lon; fix[i][2] = gpx.alt;
+			}
+			option_wls = 0;
+			for(int i=0; i<nf; i++) {
+				gps_us = 0;
+				print_frame(frames+i*RS92FRAMELEN, RS92FRAMELEN);
+				r.stage[2].us += gps_us;
+				if(gpx.lat==0 || fix[i][0]==0) continue;
+				// distance of both fixes (local flat approximation)
+				double dn = (gpx.lat-fix[i][0])*111195.0;
+				double de = (gpx.lon-fix[i][1])*111195.0*cos(gpx.lat*M_PI/180);
+				double dh = gpx.alt-fix[i][2];
+				double d = sqrt(dn*dn+de*de+dh*dh);
+				dsum += d; nd++;
+				if(d>dmax) dmax = d;
+			}
+			option_wls = 1;
+			for(int i=0; i<nf; i++) countResult(&r, corr[i], corr[i]>=0);
+		}
+		printResult("RS92", v, &r);
+		if(nd>0) Serial.printf("    wls vs. comb: %d fixes, mean distance %.1fm, max %.1fm\n", nd, dsum/nd, dmax);
+	}
+	free(stream);
+	free(frames);
+	freeCorpus(&c);
+}
+
+void runBenchmark(const char *prefix) {
+	SX1278Radio *radio = sx1278.getRadio();
+	sx1278.setRadio(&benchsim);
+	Serial.println("Running decoder benchmark");
+	benchRS41(prefix);
+	benchDFM(prefix);
+	benchRS92(prefix);
+	sx1278.setRadio(radio);
+}
@@ -0,0 +1,46 @@
+/*
+ * Bench.h
+ * Decoder throughput benchmark, replaying recorded frames
+ * (replay files as written by sx1278.startCapture, see SX1278Sim.h)
+ *
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+
+#ifndef Bench_h
+#define Bench_h
+
+#include <stdint.h>
+
+#define BENCH_MAXFRAMES 32	// frames loaded from each corpus file
+#define BENCH_ROUNDS 4		// each corpus is decoded BENCH_ROUNDS times
+
+// Variants generated from each recorded frame
+// (BV_FADE and BV_TRUNC also report the destroyed bytes like the radio
+// does in sx1278.rxquality, for decoders that can use them as erasures)
+enum BenchVariant { BV_CLEAN, BV_BITERR, BV_BURST, BV_FADE, BV_TRUNC, BV_MAX };
+
+// Timing of one processing stage (decoder calls only, debug output of the
+// decoders is not included)
+typedef struct st_benchstage {
+	const char *name;
+	uint32_t us;		// total time
+} BenchStage;
+
+// Result for one decoder / variant
+typedef struct st_benchresult {
+	uint32_t frames;
+	uint32_t ok;		// frames decoded without error (crc/ecc ok)
+	uint32_t corrected;	// frames with corrected errors
+	uint32_t failed;	// frames with uncorrectable errors
+	uint32_t corrections;	// total number of corrected bytes/bits
+	uint32_t us;		// total time of all stages
+	BenchStage stage[3];
+} BenchResult;
+
+// Run benchmark for all decoders with corpus files prefix+"rs41.rec",
+// prefix+"dfm.rec", prefix+"rs92.rec" (e.g. prefix "/spiffs/")
+void runBenchmark(const char *prefix);
+
+extern const char *benchVariantStr[BV_MAX];
+
+#endif
@@ -15,6 +15,8 @@
 int DFM::setup(float frequency, int inv) 
 {
 	inverse = inv;
+	Genhamtab();
+	if(!idList) idList = (DFMIDState *)calloc(MAXSONDE+1, sizeof(DFMIDState));
 #if DFM_DEBUG
 	Serial.printf("Setup sx1278 for DFM sonde (inv=%d)\n",inv);
 #endif
@@ -134,7 +136,7 @@ int DFM::hamming(uint8_t *ham, int L, uint8_t *sym) {
 	for (i = 0; i < L; i++) {  // L bytes (4bit data, 4bit parity)
 		if (use_ecc) {
 			int res = check(ham+8*i);
-			if(ret>=0 && res>=0) ret += res; else ret=-1;
+			if(ret>=0 && res>=0) ret += res>0; else ret=-1;
 		}
 		// systematic Hamming code: copy bits 0..3
 		for (j = 0; j < 4; j++) {
@@ -144,6 +146,75 @@ int DFM::hamming(uint8_t *ham, int L, uint8_t *sym) {
 	return ret;
 }
 
+/*
+ * Packed decoding: each Hamming code word is handled as one byte
+ * (bit 7: code[0] .. bit 0: code[7], i.e. data nibble in the upper half)
+ */
+// hamtab[code word]: corrected data nibble | HAM_CORR if one bit was corrected,
+// | HAM_FAIL if uncorrectable; generated from check(), so both paths agree
+#define HAM_CORR 0x10
+#define HAM_FAIL 0x80
+static uint8_t hamtab[256];
+static bool hamtabok = false;
+
+void DFM::Genhamtab() {
+	if(hamtabok) return;
+	for(int cw=0; cw<256; cw++) {
+		uint8_t code[8];
+		for(int j=0; j<8; j++) code[j] = (cw>>(7-j))&1;
+		int res = check(code);
+		// uncorrectable: data bits are used as received
+		hamtab[cw] = bits2val(code, 4) | (res<0 ? HAM_FAIL : res>0 ? HAM_CORR : 0);
+	}
+	hamtabok = true;
+}
+
+// Transpose 8x8 bit matrix (byte 7-i of x: row i, bit 7-j: column j), Hacker's Delight 7-3
+static inline uint64_t transpose8(uint64_t x) {
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;  x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x = x ^ t ^ (t << 28);
+	return x;
+}
+
+// Same as deinterleave(), but produces L code words as bytes (inverted like block[])
+// The L*8 input bits are 8 rows of L bits; code word i is column i
+void DFM::deinterleavePacked(const uint8_t *str, int L, uint8_t *cw) {
+	uint8_t in[16];
+	uint64_t x[2] = { 0, 0 };
+	memcpy(in, str, L);
+	memset(in+L, 0, 16-L);
+	for(int j=0; j<B; j++) {
+		int pos = L*j;
+		uint32_t w = (in[pos>>3]<<16) | (in[(pos>>3)+1]<<8) | in[(pos>>3)+2];
+		// row j, column 0 at bit 15
+		uint16_t row = ((w >> (24-(pos&7)-L)) & ((1<<L)-1)) << (16-L);
+		x[0] |= (uint64_t)(row>>8) << (8*(7-j));
+		x[1] |= (uint64_t)(row&0xFF) << (8*(7-j));
+	}
+	x[0] = transpose8(x[0]);
+	x[1] = transpose8(x[1]);
+	for(int i=0; i<L; i++) {
+		cw[i] = ~(uint8_t)(x[i>>3] >> (8*(7-(i&7))));
+	}
+}
+
+// Same as hamming()+bitsToBytes(): correct L code words and pack data nibbles into bytes
+int DFM::hammingPacked(const uint8_t *cw, int L, uint8_t *bytes) {
+	int ret = 0;
+	for(int i=0; i<L; i++) {
+		uint8_t h = use_ecc ? hamtab[cw[i]] : cw[i]>>4;
+		if(h&HAM_FAIL) ret = -1;
+		else if(ret>=0 && (h&HAM_CORR)) ret++;
+		if(i&1) bytes[i>>1] |= h&0x0F;
+		else bytes[i>>1] = (h&0x0F)<<4;
+	}
+	// odd length: last nibble in lower half, as with bitsToBytes
+	if(L&1) bytes[L>>1] >>= 4;
+	return ret;
+}
+
 DFM::DFM() {
 }
 
@@ -162,29 +233,54 @@ void DFM::printRaw(const char *label, int len, int ret, const uint8_t *data)
 	Serial.print(" ");
 }
 
+DFMIDState *DFM::idState()
+{
+	static DFMIDState none;
+	if(!idList) return &none;
+	DFMIDState *s = &idList[sonde.rxIndex];
+	if(s->freq != sonde.rxsi()->freq) {
+		memset(s, 0, sizeof(DFMIDState));
+		s->freq = sonde.rxsi()->freq;
+	}
+	return s;
+}
+
+void DFM::remapChannels(const int8_t *map, int n)
+{
+	if(!idList) return;
+	// map is ascending with map[i]<=i, moving forward does not overwrite pending entries
+	int nnew = 0;
+	for(int i=0; i<n; i++) {
+		if(map[i]<0) continue;
+		if(map[i]!=i) idList[map[i]] = idList[i];
+		nnew = map[i]+1;
+	}
+	memset(idList+nnew, 0, (n-nnew)*sizeof(DFMIDState));
+}
+
 void DFM::decodeCFG(uint8_t *cfg)
 {
-	static int lowid, highid, idgood=0, type=0;
-	if((cfg[0]>>4)==0x06 && type==0) {   // DFM-6 ID
-		lowid = ((cfg[0]&0x0F)<<20) | (cfg[1]<<12) | (cfg[2]<<4) | (cfg[3]&0x0f);
-		Serial.print("DFM-06 ID: "); Serial.print(lowid, HEX);
-		snprintf(sonde.si()->id, 10, "%x", lowid);
-		sonde.si()->validID = true;
+	DFMIDState *ids = idState();
+	if((cfg[0]>>4)==0x06 && ids->type==0) {   // DFM-6 ID
+		ids->lowid = ((cfg[0]&0x0F)<<20) | (cfg[1]<<12) | (cfg[2]<<4) | (cfg[3]&0x0f);
+		Serial.print("DFM-06 ID: "); Serial.print(ids->lowid, HEX);
+		snprintf(sonde.rxsi()->id, 10, "%x", ids->lowid);
+		sonde.rxsi()->validID = true;
 	}
 	if((cfg[0]>>4)==0x0A) {  // DMF-9 ID
-		type=9;
+		ids->type=9;
 		if(cfg[3]==1) {
-			lowid = (cfg[1]<<8) | cfg[2];
-			idgood |= 1;
+			ids->lowid = (cfg[1]<<8) | cfg[2];
+			ids->idgood |= 1;
 		} else {
-			highid = (cfg[1]<<8) | cfg[2];
-			idgood |= 2;
+			ids->highid = (cfg[1]<<8) | cfg[2];
+			ids->idgood |= 2;
 		}
-		if(idgood==3) {
-			uint32_t dfmid = (highid<<16) | lowid;
+		if(ids->idgood==3) {
+			uint32_t dfmid = (ids->highid<<16) | ids->lowid;
 			Serial.print("DFM-09 ID: "); Serial.print(dfmid); 
-			snprintf(sonde.si()->id, 10, "%d", dfmid);
-			sonde.si()->validID = true;
+			snprintf(sonde.rxsi()->id, 10, "%d", dfmid);
+			sonde.rxsi()->validID = true;
 		}
 	}
 }
@@ -209,9 +305,9 @@ void DFM::decodeDAT(uint8_t *dat)
 		vh = ((uint16_t)dat[4]<<8) + dat[5];
 		Serial.print("GPS-lat: "); Serial.print(lat*0.0000001);
 		Serial.print(", hor-V: "); Serial.print(vh*0.01);
-		sonde.si()->lat = lat*0.0000001;
-		sonde.si()->hs = vh*0.01;
-		sonde.si()->validPos |= 0x11; 
+		sonde.rxsi()->lat = lat*0.0000001;
+		sonde.rxsi()->hs = vh*0.01;
+		sonde.rxsi()->validPos |= 0x11; 
 		}
 		break;
 	case 3:
@@ -221,9 +317,9 @@ void DFM::decodeDAT(uint8_t *dat)
 		dir = ((uint16_t)dat[4]<<8) + dat[5];
 		Serial.print("GPS-lon: "); Serial.print(lon*0.0000001);
 		Serial.print(", dir: "); Serial.print(dir*0.01);
-		sonde.si()->lon = lon*0.0000001;
-		sonde.si()->dir = dir*0.01;
-		sonde.si()->validPos |= 0x42;
+		sonde.rxsi()->lon = lon*0.0000001;
+		sonde.rxsi()->dir = dir*0.01;
+		sonde.rxsi()->validPos |= 0x42;
 		}
 		break;
 	case 4:
@@ -233,9 +329,9 @@ void DFM::decodeDAT(uint8_t *dat)
 		vv = (int16_t)( ((int16_t)dat[4]<<8) | dat[5] );
 		Serial.print("GPS-height: "); Serial.print(alt*0.01);
 		Serial.print(", vv: "); Serial.print(vv*0.01);
-		sonde.si()->alt = alt*0.01;
-		sonde.si()->vs = vv*0.01;
-		sonde.si()->validPos |= 0x0C;
+		sonde.rxsi()->alt = alt*0.01;
+		sonde.rxsi()->vs = vv*0.01;
+		sonde.rxsi()->validPos |= 0x0C;
 		}
 		break;
 	case 8:
@@ -266,36 +362,62 @@ void DFM::bitsToBytes(uint8_t *bits, uint8_t *bytes, int len)
 	bytes[(i-1)/8] &= 0x0F;
 }
 
-int DFM::receive() {
-	byte data[1000];  // pending data from previous mode may write more than 33 bytes. TODO. 
-	for(int i=0; i<2; i++) {
-	sx1278.setPayloadLength(33);    // Expect 33 bytes (7+13+13 bytes)
-
-	sx1278.writeRegister(REG_OP_MODE, FSK_RX_MODE);
-	int e = sx1278.receivePacketTimeout(1000, data);
-	if(e) { return RX_TIMEOUT; } //if timeout... return 1
-
-	Serial.printf("inverse is %d\b", inverse);
+int DFM::correctFrame(uint8_t *data) {
 	if(!inverse) { for(int i=0; i<33; i++) { data[i]^=0xFF; } }
+	if(use_packed) {
+		uint8_t cw[13];
+		deinterleavePacked(data, 7, cw);
+		ret0 = hammingPacked(cw, 7, byte_conf);
+		deinterleavePacked(data+7, 13, cw);
+		ret1 = hammingPacked(cw, 13, byte_dat1);
+		deinterleavePacked(data+20, 13, cw);
+		ret2 = hammingPacked(cw, 13, byte_dat2);
+		if(ret0<0 || ret1<0 || ret2<0) return -1;
+		return ret0 + ret1 + ret2;
+	}
 	deinterleave(data, 7, hamming_conf);
 	deinterleave(data+7, 13, hamming_dat1);
 	deinterleave(data+20, 13, hamming_dat2);
   
-	int ret0 = hamming(hamming_conf,  7, block_conf);
-	int ret1 = hamming(hamming_dat1, 13, block_dat1);
-	int ret2 = hamming(hamming_dat2, 13, block_dat2);
+	ret0 = hamming(hamming_conf,  7, block_conf);
+	ret1 = hamming(hamming_dat1, 13, block_dat1);
+	ret2 = hamming(hamming_dat2, 13, block_dat2);
 
-	byte byte_conf[4], byte_dat1[7], byte_dat2[7];
 	bitsToBytes(block_conf, byte_conf, 7);
 	bitsToBytes(block_dat1, byte_dat1, 13);
 	bitsToBytes(block_dat2, byte_dat2, 13);
 
+	if(ret0<0 || ret1<0 || ret2<0) return -1;
+	return ret0 + ret1 + ret2;
+}
+
+void DFM::decodeFrame() {
 	printRaw("CFG", 7, ret0, byte_conf);
 	printRaw("DAT", 13, ret1, byte_dat1);
 	printRaw("DAT", 13, ret2, byte_dat2);
 	decodeCFG(byte_conf);
 	decodeDAT(byte_dat1);
 	decodeDAT(byte_dat2);
+}
+
+void DFM::getFrame(uint8_t *out) {
+	memcpy(out, byte_conf, 4);
+	memcpy(out+4, byte_dat1, 7);
+	memcpy(out+11, byte_dat2, 7);
+}
+
+int DFM::receive() {
+	byte data[1000];  // pending data from previous mode may write more than 33 bytes. TODO. 
+	for(int i=0; i<2; i++) {
+	sx1278.setPayloadLength(33);    // Expect 33 bytes (7+13+13 bytes)
+
+	sx1278.writeRegister(REG_OP_MODE, FSK_RX_MODE);
+	int e = sx1278.receivePacketTimeout(1000, data);
+	if(e) { return RX_TIMEOUT; } //if timeout... return 1
+
+	Serial.printf("inverse is %d\b", inverse);
+	lastCorr = correctFrame(data);
+	decodeFrame();
 	}
 	return RX_OK;
 }
@@ -303,22 +425,6 @@ int DFM::receive() {
 // moved to a single function in Sonde(). This function can be used for additional
 // processing here, that takes too long for doing in the RX task loop
 int DFM::waitRXcomplete() {
-#if 0
-	int res=0;
-	uint32_t t0 = millis();
-	while( rxtask.receiveResult < 0 && millis()-t0 < 2000) { delay(50); }
-
-	if( rxtask.receiveResult<0 || rxtask.receiveResult==RX_TIMEOUT) { 
-                res = RX_TIMEOUT;
-        } else if ( rxtask.receiveResult ==0) {
-                res = RX_OK;
-        } else {
-                res = RX_ERROR;
-        }
-        rxtask.receiveResult = -1;
-        Serial.printf("waitRXcomplete returning %d\n", res);
-        return res;
-#endif
 	return 0;
 }
 
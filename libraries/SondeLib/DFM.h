@@ -19,11 +19,20 @@
 #define DFM_NORMAL 0
 #define DFM_INVERSE 1
 
+// The DFM-09 ID is sent in two halves in different frames. They are collected per
+// channel, as the scheduler may hop to another channel after each frame.
+typedef struct st_dfmidstate {
+	float freq;		// channel frequency this state belongs to
+	int lowid, highid, idgood, type;
+} DFMIDState;
+
 /* Main class */
 class DFM
 {
 private:
 	int inverse=0;
+	DFMIDState *idList = NULL;	// per channel (sonde index of the RX task)
+	DFMIDState *idState();
 
 	void deinterleave(uint8_t *str, int L, uint8_t *block);
 	uint32_t bits2val(const uint8_t *bits, int len);
@@ -33,6 +42,9 @@ private:
 	void decodeCFG(uint8_t *cfg);
 	void decodeDAT(uint8_t *dat);
 	void bitsToBytes(uint8_t *bits, uint8_t *bytes, int len);
+	void Genhamtab();
+	void deinterleavePacked(const uint8_t *str, int L, uint8_t *cw);
+	int hammingPacked(const uint8_t *cw, int L, uint8_t *bytes);
 
 #define B 8
 #define S 4
@@ -44,6 +56,9 @@ private:
 	uint8_t block_dat1[13*S];  // 13*4=52
 	uint8_t block_dat2[13*S];
 
+	uint8_t byte_conf[4], byte_dat1[7], byte_dat2[7];
+	int ret0, ret1, ret2;
+
 	uint8_t H[4][8] =  // extended Hamming(8,4) particy check matrix
              {{ 0, 1, 1, 1, 1, 0, 0, 0},
               { 1, 0, 1, 1, 0, 1, 0, 0},
@@ -59,9 +74,27 @@ public:
 	int receive();
 	int waitRXcomplete();
 
+	// Individual processing stages of receive(), also used by Bench.cpp
+	// deinterleave and Hamming-correct a 33 byte frame,
+	// returns number of corrected bits, -1 if uncorrectable error
+	int correctFrame(uint8_t *data);
+	// decode CFG and DAT blocks of a corrected frame
+	void decodeFrame();
+	// copy the corrected CFG and DAT bytes of the last frame (DFM_FRAMEBYTES)
+	void getFrame(uint8_t *out);
+	// channel list was compacted, map[old index] = new index or -1 (Sonde::clearCandidates)
+	void remapChannels(const int8_t *map, int n);
+
+	// result of correctFrame for the last frame received (-1: uncorrectable)
+	int lastCorr = 0;
+
 	int use_ecc = 1;
+	// 1: table driven decoding of packed code words, 0: bit by bit (reference)
+	int use_packed = 1;
 };
 
+#define DFM_FRAMEBYTES (4+7+7)
+
 extern DFM dfm;
 
 #endif
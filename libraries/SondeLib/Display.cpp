@@ -18,7 +18,7 @@ extern MicroNMEA nmea;
 
 SPIClass spiDisp(HSPI);
 
-const char *sondeTypeStr[5] = { "DFM6", "DFM9", "RS41", "RS92" };
+const char *sondeTypeStr[5] = { "DFM6", "DFM9", "RS41", "RS92", "AUTO" };
 
 byte myIP_tiles[8*11];
 static uint8_t ap_tile[8]={0x00,0x04,0x22,0x92, 0x92, 0x22, 0x04, 0x00};
@@ -189,14 +189,17 @@ void U8x8Display::clear() {
 // For u8x8 oled display: 0=small font, 1=large font 7x14
 void U8x8Display::setFont(int large) {
 	u8x8->setFont((large)?u8x8_font_7x14_1x2_r:u8x8_font_chroma48medium8_r);
+	_large = large;
 }
 
 void U8x8Display::drawString(uint8_t x, uint8_t y, const char *s) {
 	u8x8->drawString(x, y, s);
+	bytesSent += strlen(s) * (_large ? 16 : 8);
 }
 
 void U8x8Display::drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr) {
 	u8x8->drawTile(x, y, cnt, tile_ptr);
+	bytesSent += cnt * 8;
 }
 void U8x8Display::welcome() {
 	u8x8->clear();
@@ -217,10 +220,20 @@ void ILI9225Display::begin() {
 			sonde.config.oled_sda, sonde.config.oled_scl, TFT_LED, TFT_BRIGHTNESS);
         tft->begin(spiDisp);
 	tft->setOrientation(1);
+	if(!tft->initFB()) Serial.println("No memory for TFT framebuffer, drawing directly");
 }
 
 void ILI9225Display::clear() {
         tft->clear();
+	tft->clearFB();
+}
+
+void ILI9225Display::beginUpdate() {
+	updating++;
+}
+
+void ILI9225Display::endUpdate() {
+	if(updating>0 && --updating==0) tft->flush();
 }
 
 // for now, 0=small=FreeSans9pt7b, 1=large=FreeSans18pt7b
@@ -240,19 +253,30 @@ void ILI9225Display::setFont(int large) {
 void ILI9225Display::drawString(uint8_t x, uint8_t y, const char *s) {
 	int16_t w,h;
 #if 1
-	tft->getGFXTextExtent(s, x*XSKIP, y*YSKIP, &w, &h);
 	int len = strlen(s);
+	if(tft->hasFB()) {
+		if(fsize) {
+			tft->fillFB(x*XSKIP, y*YSKIP+3, x*XSKIP + len*17, y*YSKIP +29, COLOR_BLACK);
+		} else {
+			tft->fillFB(x*XSKIP, y*YSKIP+3, x*XSKIP + len*14, y*YSKIP +22, COLOR_BLACK);
+		}
+		tft->drawTextFB(x*XSKIP, (1+y)*YSKIP, s, COLOR_WHITE);
+		if(!updating) tft->flush();
+		return;
+	}
+	tft->getGFXTextExtent(s, x*XSKIP, y*YSKIP, &w, &h);
 	if(fsize) {
 		tft->fillRectangle(x*XSKIP, y*YSKIP+3, x*XSKIP + len*17, y*YSKIP +29, COLOR_BLACK);
 	} else {
 		tft->fillRectangle(x*XSKIP, y*YSKIP+3, x*XSKIP + len*14, y*YSKIP +22, COLOR_BLACK);
 	}
-        tft->drawGFXText(x*XSKIP, (1+y)*YSKIP, s, COLOR_WHITE);
+	tft->drawTextCached(x*XSKIP, (1+y)*YSKIP, s, COLOR_WHITE, COLOR_BLACK);
 #endif
 }
 
 void ILI9225Display::drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr) {
 	tft->drawTile(x, 2*y, cnt, tile_ptr);
+	if(!updating) tft->flush();
 #if 0
 	int i,j;
 	tft->startWrite();
@@ -284,6 +308,18 @@ void ILI9225Display::welcome() {
 
 void MY_ILI9225::drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr) {
         int i,j;
+	if(fb) {
+		uint8_t fg = colorIndex(COLOR_GREEN), bg = colorIndex(COLOR_BLUE);
+		for(i=0; i<cnt*8; i++) {
+			uint8_t v = tile_ptr[i];
+			for(j=0; j<8; j++) {
+				setPixelFB(8*x+i, 8*y+j, (v&0x01) ? fg : bg);
+				v >>= 1;
+			}
+		}
+		markDirty(8*x, 8*y, 8*x+cnt*8-1, 8*y+7);
+		return;
+	}
         startWrite();
         for(int i=0; i<cnt*8; i++) {
                 uint8_t v = tile_ptr[i];
@@ -295,6 +331,243 @@ void MY_ILI9225::drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr)
         endWrite();
 }
 
+bool MY_ILI9225::initFB() {
+	fbw = maxX();
+	fbh = maxY();
+	int nband = (fbh+FB_BAND-1)/FB_BAND;
+	fb = (uint8_t *)malloc(fbw*fbh/2);
+	linebuf = (uint16_t *)malloc(fbw*FB_BAND*sizeof(uint16_t));
+	dirtyX0 = (int16_t *)malloc(nband*sizeof(int16_t));
+	dirtyX1 = (int16_t *)malloc(nband*sizeof(int16_t));
+	if(!fb || !linebuf || !dirtyX0 || !dirtyX1) {
+		free(fb); free(linebuf); free(dirtyX0); free(dirtyX1);
+		fb = NULL;
+		return false;
+	}
+	palette[0] = COLOR_BLACK;
+	npalette = 1;
+	clearFB();
+	return true;
+}
+
+void MY_ILI9225::clearFB() {
+	if(!fb) return;
+	memset(fb, 0, fbw*fbh/2);
+	for(int b=0; b<(fbh+FB_BAND-1)/FB_BAND; b++) {
+		dirtyX0[b] = fbw;
+		dirtyX1[b] = -1;
+	}
+}
+
+// palette entry of color; if all entries are used, the last one is replaced
+uint8_t MY_ILI9225::colorIndex(uint16_t color) {
+	for(int i=0; i<npalette; i++) {
+		if(palette[i]==color) return i;
+	}
+	if(npalette<FB_COLORS) npalette++;
+	palette[npalette-1] = color;
+	return npalette-1;
+}
+
+void MY_ILI9225::setPixelFB(int16_t x, int16_t y, uint8_t c) {
+	if(x<0 || y<0 || x>=fbw || y>=fbh) return;
+	uint8_t *p = fb + (y*fbw + x)/2;
+	if(x&1) *p = (*p&0x0F) | (c<<4); else *p = (*p&0xF0) | c;
+}
+
+void MY_ILI9225::markDirty(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
+	if(x0<0) x0 = 0;
+	if(y0<0) y0 = 0;
+	if(x1>=fbw) x1 = fbw-1;
+	if(y1>=fbh) y1 = fbh-1;
+	if(x0>x1 || y0>y1) return;
+	for(int b=y0/FB_BAND; b<=y1/FB_BAND; b++) {
+		if(x0<dirtyX0[b]) dirtyX0[b] = x0;
+		if(x1>dirtyX1[b]) dirtyX1[b] = x1;
+	}
+}
+
+void MY_ILI9225::fillFB(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color) {
+	uint8_t c = colorIndex(color);
+	if(x0<0) x0 = 0;
+	if(y0<0) y0 = 0;
+	if(x1>=fbw) x1 = fbw-1;
+	if(y1>=fbh) y1 = fbh-1;
+	for(int y=y0; y<=y1; y++) {
+		for(int x=x0; x<=x1; x++) setPixelFB(x, y, c);
+	}
+	markDirty(x0, y0, x1, y1);
+}
+
+// pixels x..x+len-1 of row y, two pixels per byte where possible
+void MY_ILI9225::fillRunFB(int16_t x, int16_t y, int16_t len, uint8_t c) {
+	if(y<0 || y>=fbh) return;
+	if(x<0) { len += x; x = 0; }
+	if(x+len>fbw) len = fbw-x;
+	if(len<=0) return;
+	uint8_t *p = fb + (y*fbw + x)/2;
+	if(x&1) { *p = (*p&0x0F) | (c<<4); p++; len--; }
+	memset(p, c | (c<<4), len/2);
+	if(len&1) p[len/2] = (p[len/2]&0xF0) | c;
+}
+
+// Glyph of ch in the current font as pixel runs, NULL if ch is not cached
+CachedGlyph *MY_ILI9225::getGlyph(uint8_t ch) {
+	for(int i=0; i<nglyphs; i++) {
+		CachedGlyph *g = &glyphCache[i];
+		if(g->ch==ch && g->font==gfxFont) return g;
+	}
+	if(nglyphs>=GLYPHCACHE_N || !strchr(GLYPHCACHE_CHARS, ch)) return NULL;
+	uint8_t first = pgm_read_byte(&gfxFont->first), last = pgm_read_byte(&gfxFont->last);
+	if(ch<first || ch>last) return NULL;
+	GFXglyph *glyph = &(((GFXglyph *)pgm_read_pointer(&gfxFont->glyph))[ch-first]);
+	uint8_t *bitmap = (uint8_t *)pgm_read_pointer(&gfxFont->bitmap);
+	CachedGlyph *g = &glyphCache[nglyphs];
+	g->w = pgm_read_byte(&glyph->width);
+	g->h = pgm_read_byte(&glyph->height);
+	if(g->w*g->h > GLYPHCACHE_MAXPIX) return NULL;
+	uint16_t bo0 = pgm_read_word(&glyph->bitmapOffset);
+	// first pass counts the runs, second pass stores them
+	g->runs = NULL;
+	for(int pass=0; pass<2; pass++) {
+		uint16_t bo = bo0;
+		uint8_t bits = 0, bit = 0;
+		int n = 0;
+		for(int yy=0; yy<g->h; yy++) {
+			int start = -1;
+			for(int xx=0; xx<=g->w; xx++) {
+				bool set = false;
+				if(xx<g->w) {
+					if(!(bit++ & 7)) bits = pgm_read_byte(&bitmap[bo++]);
+					set = bits & 0x80;
+					bits <<= 1;
+				}
+				if(set && start<0) start = xx;
+				if(!set && start>=0) {
+					if(pass) { g->runs[n].x = start; g->runs[n].y = yy; g->runs[n].len = xx-start; }
+					n++;
+					start = -1;
+				}
+			}
+		}
+		if(pass==0) {
+			if(n>255) return NULL;
+			g->nruns = n;
+			if(n==0) break;
+			g->runs = (GlyphRun *)malloc(n*sizeof(GlyphRun));
+			if(!g->runs) return NULL;
+		}
+	}
+	g->font = gfxFont;
+	g->ch = ch;
+	g->xa = pgm_read_byte(&glyph->xAdvance);
+	g->xo = pgm_read_byte(&glyph->xOffset);
+	g->yo = pgm_read_byte(&glyph->yOffset);
+	nglyphs++;
+	return g;
+}
+
+void MY_ILI9225::drawTextCached(int16_t x, int16_t y, const char *s, uint16_t fg, uint16_t bg) {
+	static uint16_t pix[GLYPHCACHE_MAXPIX];
+	if(!gfxFont) return;
+	for(; *s; s++) {
+		CachedGlyph *g = getGlyph(*s);
+		if(!g) {
+			x += TFT22_ILI9225::drawGFXChar(x, y, *s, fg) + 1;
+			continue;
+		}
+		int16_t gx = x + g->xo, gy = y + g->yo;
+		if(g->w>0 && gx>=0 && gy>=0 && gx+g->w<=maxX() && gy+g->h<=maxY()) {
+			for(int i=0; i<g->w*g->h; i++) pix[i] = bg;
+			for(int r=0; r<g->nruns; r++) {
+				uint16_t *p = pix + g->runs[r].y*g->w + g->runs[r].x;
+				for(int i=0; i<g->runs[r].len; i++) p[i] = fg;
+			}
+			beginPixels(gx, gy, gx+g->w-1, gy+g->h-1);
+			writePixels(pix, g->w*g->h);
+			endPixels();
+		}
+		x += g->xa + 1;
+	}
+}
+
+// same rendering as TFT22_ILI9225::drawGFXText, into the framebuffer
+void MY_ILI9225::drawTextFB(int16_t x, int16_t y, const char *s, uint16_t color) {
+	if(!gfxFont) return;
+	uint8_t c = colorIndex(color);
+	uint8_t first = pgm_read_byte(&gfxFont->first), last = pgm_read_byte(&gfxFont->last);
+	GFXglyph *glyphs = (GFXglyph *)pgm_read_pointer(&gfxFont->glyph);
+	uint8_t *bitmap = (uint8_t *)pgm_read_pointer(&gfxFont->bitmap);
+	for(; *s; s++) {
+		uint8_t ch = *s;
+		if(ch<first || ch>last) continue;
+		CachedGlyph *g = getGlyph(ch);
+		if(g) {
+			for(int r=0; r<g->nruns; r++) {
+				fillRunFB(x+g->xo+g->runs[r].x, y+g->yo+g->runs[r].y, g->runs[r].len, c);
+			}
+			markDirty(x+g->xo, y+g->yo, x+g->xo+g->w-1, y+g->yo+g->h-1);
+			x += g->xa + 1;
+			continue;
+		}
+		GFXglyph *glyph = &glyphs[ch-first];
+		uint16_t bo = pgm_read_word(&glyph->bitmapOffset);
+		uint8_t  w  = pgm_read_byte(&glyph->width),
+			 h  = pgm_read_byte(&glyph->height),
+			 xa = pgm_read_byte(&glyph->xAdvance);
+		int8_t   xo = pgm_read_byte(&glyph->xOffset),
+			 yo = pgm_read_byte(&glyph->yOffset);
+		uint8_t  bits = 0, bit = 0;
+		for(int yy=0; yy<h; yy++) {
+			for(int xx=0; xx<w; xx++) {
+				if(!(bit++ & 7)) bits = pgm_read_byte(&bitmap[bo++]);
+				if(bits & 0x80) setPixelFB(x+xo+xx, y+yo+yy, c);
+				bits <<= 1;
+			}
+		}
+		markDirty(x+xo, y+yo, x+xo+w-1, y+yo+h-1);
+		x += xa + 1;
+	}
+}
+
+// Send dirty parts of the framebuffer to the display
+void MY_ILI9225::flush() {
+	if(!fb) return;
+	int nband = (fbh+FB_BAND-1)/FB_BAND;
+	int b = 0;
+	while(b<nband) {
+		if(dirtyX0[b]>dirtyX1[b]) { b++; continue; }
+		// adjacent dirty bands share one window (union of their columns)
+		int e = b;
+		int16_t x0 = dirtyX0[b], x1 = dirtyX1[b];
+		while(e+1<nband && dirtyX0[e+1]<=dirtyX1[e+1]) {
+			e++;
+			if(dirtyX0[e]<x0) x0 = dirtyX0[e];
+			if(dirtyX1[e]>x1) x1 = dirtyX1[e];
+		}
+		int y0 = b*FB_BAND;
+		int y1 = (e+1)*FB_BAND > fbh ? fbh-1 : (e+1)*FB_BAND-1;
+		int w = x1-x0+1;
+		beginPixels(x0, y0, x1, y1);
+		int n = 0;
+		for(int y=y0; y<=y1; y++) {
+			const uint8_t *row = fb + y*fbw/2;
+			for(int x=x0; x<=x1; x++) {
+				uint8_t v = row[x/2];
+				linebuf[n++] = palette[(x&1) ? v>>4 : v&0x0F];
+			}
+			if(n+w > fbw*FB_BAND || y==y1) {
+				writePixels(linebuf, n);
+				n = 0;
+			}
+		}
+		endPixels();
+		for(; b<=e; b++) {
+			dirtyX0[b] = fbw;
+			dirtyX1[b] = -1;
+		}
+	}
+}
 
 uint16_t MY_ILI9225::drawGFXChar(int16_t x, int16_t y, unsigned char c, uint16_t color) {
 
@@ -350,6 +623,7 @@ void Display::init() {
 	delay(100);
 	Serial.println("Display initialized");
 	rdis->clear();
+	invalidate();
 }
 
 
@@ -558,8 +832,14 @@ void Display::initFromFile() {
 
 void Display::setLayout(int layoutIdx) {
 	layout = &layouts[layoutIdx];
+	invalidate();
 }
 
+// set while drawEntry() runs a draw function only to hash its output:
+// debug output of draw functions is printed in the real pass only
+static bool hashPass = false;
+#define DRAW_DEBUG (sonde.config.debug && !hashPass)
+
 void Display::drawLat(DispEntry *de) {
 	rdis->setFont(de->fmt);
 	if(!sonde.si()->validPos) {
@@ -635,7 +915,7 @@ void Display::drawRSSI(DispEntry *de) {
 	rdis->setFont(de->fmt);
 	snprintf(buf, 16, "-%d   ", sonde.si()->rssi/2);
 	int len=strlen(buf)-3;
-	Serial.printf("drawRSSI: %d %d %d (%d)[%d]\n", de->y, de->x, sonde.si()->rssi/2, sonde.currentSonde, len);
+	if(DRAW_DEBUG) Serial.printf("drawRSSI: %d %d %d (%d)[%d]\n", de->y, de->x, sonde.si()->rssi/2, sonde.currentSonde, len);
 	buf[5]=0;
 	rdis->drawString(de->x,de->y,buf);
 	rdis->drawTile(de->x+len, de->y, 1, (sonde.si()->rssi&1)?halfdb_tile1:empty_tile1);
@@ -698,7 +978,7 @@ void Display::drawGPS(DispEntry *de) {
 		// GPS long
 		{
 		float lon = nmea.getLongitude()*0.000001;
-		Serial.print("lon: "); Serial.println(lon);
+		if(DRAW_DEBUG) { Serial.print("lon: "); Serial.println(lon); }
 		snprintf(buf, 16, "%2.5f", lon);
 		rdis->drawString(de->x,de->y,buf);
 		}
@@ -707,7 +987,7 @@ void Display::drawGPS(DispEntry *de) {
 		// GPS lat
 		{
 		float lat = nmea.getLatitude()*0.000001;
-		Serial.print("lat: "); Serial.println(lat);
+		if(DRAW_DEBUG) { Serial.print("lat: "); Serial.println(lat); }
 		snprintf(buf, 16, "%2.5f", lat);
 		rdis->drawString(de->x,de->y,buf);
 		}
@@ -766,7 +1046,7 @@ void Display::drawGPS(DispEntry *de) {
 		float x = cos(lat1)*sin(lat2) - sin(lat1)*cos(lat2)*cos(lon2-lon1);
 		float dir = atan2(y, x)/PI*180;
 		if(dir<0) dir+=360;
-		Serial.printf("direction is %.2f\n", dir);
+		if(DRAW_DEBUG) Serial.printf("direction is %.2f\n", dir);
 		snprintf(buf, 16, "%3d", (int)dir);
 		buf[3]=0;
 		rdis->drawString(de->x, de->y, buf);
@@ -808,55 +1088,113 @@ void Display::setIP(const char *ip, bool AP) {
 }
 
 
+/* Display diffing: the draw function of an element is first run on a
+ * HashDisplay that only computes a hash of everything it would draw.
+ * Only if that differs from the hash of the last drawing, it is run
+ * again on the real display.
+ */
+class HashDisplay : public RawDisplay {
+public:
+	uint32_t hash;
+	void mix(const uint8_t *p, int len) {
+		while(len--) { hash ^= *p++; hash *= 16777619; }	// FNV-1a
+	}
+	void begin() {}
+	void clear() {}
+	void welcome() {}
+	void setFont(int nr) { uint8_t b = nr; mix(&b, 1); }
+	void drawString(uint8_t x, uint8_t y, const char *s) {
+		uint8_t b[2] = { x, y };
+		mix(b, 2);
+		mix((const uint8_t *)s, strlen(s)+1);
+	}
+	void drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr) {
+		uint8_t b[3] = { x, y, cnt };
+		mix(b, 3);
+		mix(tile_ptr, cnt*8);
+	}
+};
+static HashDisplay hashdis;
+
+void Display::drawEntry(DispEntry *de) {
+	RawDisplay *real = rdis;
+	hashdis.hash = 2166136261u ^ generation;
+	rdis = &hashdis;
+	hashPass = true;
+	de->func(de);
+	hashPass = false;
+	rdis = real;
+	updateRate();
+	if(hashdis.hash == de->hash) return;
+	de->func(de);
+	de->hash = hashdis.hash;
+}
+
+void Display::updateRate() {
+	uint32_t now = millis();
+	if(now - rateStart < 1000) return;
+	uint32_t bytes = rdis->getBytesSent();
+	bytesPerSec = (uint64_t)(bytes - rateBytes) * 1000 / (now - rateStart);
+	if(sonde.config.debug) Serial.printf("Display: %d bytes/s\n", bytesPerSec);
+	rateStart = now;
+	rateBytes = bytes;
+}
+
 void Display::updateDisplayPos() {
+	rdis->beginUpdate();
 	for(DispEntry *di=layout->de; di->func != NULL; di++) {
 		if(di->func != disp.drawLat && di->func != disp.drawLon) continue;
-		di->func(di);
+		drawEntry(di);
 	}
+	rdis->endUpdate();
 }
 void Display::updateDisplayPos2() {
+	rdis->beginUpdate();
 	for(DispEntry *di=layout->de; di->func != NULL; di++) {
 		if(di->func != disp.drawAlt && di->func != disp.drawHS && di->func != disp.drawVS) continue;
-		di->func(di);
+		drawEntry(di);
 	}
+	rdis->endUpdate();
 }
 void Display::updateDisplayID() {
 	for(DispEntry *di=layout->de; di->func != NULL; di++) {
 		if(di->func != disp.drawID) continue;
-		di->func(di);
+		drawEntry(di);
 	}
 }
 void Display::updateDisplayRSSI() {
 	for(DispEntry *di=layout->de; di->func != NULL; di++) {
 		if(di->func != disp.drawRSSI) continue;
-		di->func(di);
+		drawEntry(di);
 	}
 }
 void Display::updateStat() {
 	for(DispEntry *di=layout->de; di->func != NULL; di++) {
 		if(di->func != disp.drawQS) continue;
-		di->func(di);
+		drawEntry(di);
 	}
 }
 
 void Display::updateDisplayRXConfig() {
        for(DispEntry *di=layout->de; di->func != NULL; di++) {
                 if(di->func != disp.drawQS && di->func != disp.drawAFC) continue;
-                di->func(di);
+                drawEntry(di);
         }
 }
 void Display::updateDisplayIP() {
        for(DispEntry *di=layout->de; di->func != NULL; di++) {
                 if(di->func != disp.drawIP) continue;
 		Serial.printf("updateDisplayIP: %d %d\n",di->x, di->y);
-                di->func(di);
+                drawEntry(di);
         }
 }
 
 void Display::updateDisplay() {
+	rdis->beginUpdate();
 	for(DispEntry *di=layout->de; di->func != NULL; di++) {
-		di->func(di);
+		drawEntry(di);
 	}
+	rdis->endUpdate();
 }
 
 Display disp = Display();
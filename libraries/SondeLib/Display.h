@@ -16,6 +16,7 @@ struct DispEntry {
 	int16_t fmt;
 	void (*func)(DispEntry *de);
 	const char *extra;
+	uint32_t hash;		// hash of the last drawn content (see Display::drawEntry)
 };
 
 struct DispInfo {
@@ -33,12 +34,19 @@ public:
 	virtual void drawString(uint8_t x, uint8_t y, const char *s) = 0;
 	virtual void drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr) = 0;
 	virtual void welcome() = 0;
+	// drawing between beginUpdate and endUpdate may be shown only at endUpdate
+	virtual void beginUpdate() {}
+	virtual void endUpdate() {}
+	// bytes sent to the panel (tile/pixel data and addressing), for statistics
+	virtual uint32_t getBytesSent() { return 0; }
 };
 
 class U8x8Display : public RawDisplay {
 private:
 	U8X8 *u8x8 = NULL; // initialize later after reading config file
 	int _type;
+	int _large = 0;
+	uint32_t bytesSent = 0;	// tile data written
 
 public:
 	U8x8Display(int type = 0) { _type = type; }
@@ -48,6 +56,31 @@ public:
         void drawString(uint8_t x, uint8_t y, const char *s);
         void drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr);
 	void welcome();
+	uint32_t getBytesSent() { return bytesSent; }
+};
+
+#define FB_BAND 8	// rows per dirty band
+#define FB_COLORS 16	// 4 bit per pixel
+
+// Glyphs of the characters in numeric fields (altitude, speed, RSSI, ...)
+// are kept per font as runs of set pixels, independent of the color.
+// drawTextFB fills the runs into the 4 bit framebuffer two pixels per byte,
+// without framebuffer drawTextCached expands them to one RGB565 window
+#define GLYPHCACHE_CHARS "0123456789.-+mk"
+#define GLYPHCACHE_N 32
+#define GLYPHCACHE_MAXPIX 1024	// larger glyphs are drawn pixel by pixel
+
+struct GlyphRun {
+	uint8_t x, y, len;	// pixels x..x+len-1 of row y are set
+};
+
+struct CachedGlyph {
+	const GFXfont *font;
+	uint8_t ch;
+	uint8_t w, h, xa;
+	int8_t xo, yo;
+	uint8_t nruns;
+	GlyphRun *runs;		// NULL if empty
 };
 
 class MY_ILI9225 : public TFT22_ILI9225 {
@@ -55,6 +88,36 @@ class MY_ILI9225 : public TFT22_ILI9225 {
 public:
 	uint16_t drawGFXChar(int16_t x, int16_t y, unsigned char c, uint16_t color);
 	void drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr);
+
+	/* Off-screen framebuffer (4 bit palette, about 19kB for 220x176).
+	 * Drawing goes to RAM only, flush() sends the changed parts of each
+	 * band of FB_BAND rows, with one address window per group of adjacent
+	 * dirty bands and the pixels streamed in bulk. */
+	bool initFB();		// after setOrientation; false if out of memory (direct drawing)
+	bool hasFB() { return fb != NULL; }
+	void clearFB();		// screen is cleared by clear()
+	void fillFB(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color);
+	void drawTextFB(int16_t x, int16_t y, const char *s, uint16_t color);
+	void flush();
+	// Draw text without framebuffer: cached glyphs (on bg) are sent with
+	// one window each, other characters pixel by pixel
+	void drawTextCached(int16_t x, int16_t y, const char *s, uint16_t fg, uint16_t bg);
+
+private:
+	uint8_t *fb = NULL;
+	uint16_t *linebuf = NULL;	// FB_BAND rows in RGB565
+	int16_t fbw = 0, fbh = 0;
+	int16_t *dirtyX0 = NULL, *dirtyX1 = NULL;	// per band, clean if x0>x1
+	uint16_t palette[FB_COLORS];
+	uint8_t npalette = 0;
+	uint8_t colorIndex(uint16_t color);
+	void setPixelFB(int16_t x, int16_t y, uint8_t c);
+	void fillRunFB(int16_t x, int16_t y, int16_t len, uint8_t c);
+	void markDirty(int16_t x0, int16_t y0, int16_t x1, int16_t y1);
+
+	CachedGlyph glyphCache[GLYPHCACHE_N];
+	int nglyphs = 0;
+	CachedGlyph *getGlyph(uint8_t ch);
 };
 
 class ILI9225Display : public RawDisplay {
@@ -62,6 +125,7 @@ private:
 	MY_ILI9225 *tft = NULL; // initialize later after reading config file
 	uint8_t yofs=0;
 	uint8_t fsize=0;
+	uint8_t updating=0;	// flush only at endUpdate
 
 
 public:
@@ -71,6 +135,10 @@ public:
         void drawString(uint8_t x, uint8_t y, const char *s);
         void drawTile(uint8_t x, uint8_t y, uint8_t cnt, uint8_t *tile_ptr);
 	void welcome();
+	void beginUpdate();
+	void endUpdate();
+	// counted by the SPI primitives of TFT22_ILI9225, covers all drawing paths
+	uint32_t getBytesSent() { return tft ? tft->bytesSent : 0; }
 };
 
 class Display {
@@ -78,6 +146,11 @@ private:
 	void freeLayouts();
 	int allocDispInfo(int entries, DispInfo *d);
 	void parseDispElement(char *text, DispEntry *de);
+	// changed with each clear/layout change, part of all element hashes
+	uint32_t generation = 0;
+	void drawEntry(DispEntry *de);
+	uint32_t rateStart = 0, rateBytes = 0;
+	void updateRate();
 
 public:
 	void initFromFile();
@@ -107,6 +180,9 @@ public:
 	static void drawText(DispEntry *de);
 	void clearIP();
 	void setIP(const char *ip, bool AP);
+	// screen content is no longer known (after clear), redraw all elements
+	void invalidate() { generation++; }
+	uint32_t bytesPerSec;	// bytes sent to the panel during the last second
 	void updateDisplayPos();
 	void updateDisplayPos2();
 	void updateDisplayID();
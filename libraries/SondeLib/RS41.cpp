@@ -14,7 +14,8 @@
 #endif
 
 #define RS41MAXLEN (320)
-static byte data[800];
+#define RS41MAXLEN_LONG (518)	// frame with extended XDATA block
+static byte data[800] __attribute__((aligned(4)));
 static int dpos = 0;
 
 static uint16_t CRCTAB[256];
@@ -58,6 +59,11 @@ static double atang2(double x, double y)
 } /* end atang2() */
 
 
+// bit-reversed bytes, and scramble[] as little endian words (for descramble())
+static uint8_t revtab[256];
+static uint32_t scramble32[16];
+static void Genscrambletab(void);
+
 static void Gencrctab(void)
 {
    uint16_t j;
@@ -80,6 +86,7 @@ int RS41::setup(float frequency)
 #endif
 	if(!initialized) {
 		Gencrctab();
+		Genscrambletab();
 		initrsc();
 		initialized = true;
 	}
@@ -144,7 +151,7 @@ int RS41::setup(float frequency)
 	RS41_DBG(Serial.println("Setting SX1278 config for RS41 finished\n"); Serial.println());
 #endif
 	// go go go
-        sx1278.setPayloadLength(RS41MAXLEN-8);    // Expect 320-8 bytes or 518-8 bytes (8 byte header)
+        sx1278.setPayloadLength(RS41MAXLEN-8);    // Expect 320-8 bytes (extended to 518-8 by frameLength41)
         sx1278.writeRegister(REG_OP_MODE, FSK_RX_MODE);
 	return retval;
 }
@@ -161,59 +168,31 @@ RS41::RS41() {
 }
 
 /* RS41 reed solomon decoder, from dxlAPRS
+ * The two interleaved codewords are decoded in place (see RSSeg):
+ * codeword k has data bytes buf[56+k+2*i] (i=len2..0) and parity bytes buf[8+24*k+i] (i=23..0)
+ * eras[k] (optional): no_eras[k] known bad positions in codeword k
  */
-static int32_t reedsolomon41(byte buf[], uint32_t buf_len, uint32_t len2)
+static int32_t reedsolomon41(byte buf[], uint32_t buf_len, uint32_t len2,
+	uint32_t eras[2][24] = NULL, uint32_t *no_eras = NULL)
 {
-   uint32_t i;
    int32_t res1;
-   /*tb1, */
    int32_t res;
-   char b1[256];
-   char b[256];
    uint32_t eraspos[24];
-   uint32_t tmp;
-   for (i = 0UL; i<=255UL; i++) {
-      b[i] = 0;
-      b1[i] = 0;
-   } /* end for */
-   tmp = len2;
-   i = 0UL;
-   if (i<=tmp) for (;; i++) {
-      b[230UL-i] = buf[i*2UL+56UL];
-      b1[230UL-i] = buf[i*2UL+57UL];
-      if (i==tmp) break;
-   } /* end for */
-   for (i = 0UL; i<=23UL; i++) {
-      b[254UL-i] = buf[i+8UL];
-      b1[254UL-i] = buf[i+32UL];
-   } /* end for */
-   res = decodersc(b, eraspos, 0);
-   res1 = decodersc(b1, eraspos, 0);
-   if (res>0L && res<=12L) {
-      tmp = len2;
-      i = 0UL;
-      if (i<=tmp) for (;; i++) {
-         buf[i*2UL+56UL] = b[230UL-i];
-         if (i==tmp) break;
-      } /* end for */
-      for (i = 0UL; i<=23UL; i++) {
-         buf[i+8UL] = b[254UL-i];
-      } /* end for */
-   }
-   if (res1>0L && res1<=12L) {
-      tmp = len2;
-      i = 0UL;
-      if (i<=tmp) for (;; i++) {
-         buf[i*2UL+57UL] = b1[230UL-i];
-         if (i==tmp) break;
-      } /* end for */
-      for (i = 0UL; i<=23UL; i++) {
-         buf[i+32UL] = b1[254UL-i];
-      } /* end for */
-   }
+   RSSeg seg[2];
+   seg[0].p = buf+56+2*len2;
+   seg[0].n = len2+1;
+   seg[0].stride = -2;
+   seg[1].p = buf+8+23;
+   seg[1].n = 24;
+   seg[1].stride = -1;
+   if(eras) memcpy(eraspos, eras[0], sizeof(eraspos));
+   res = decodersc_frame(seg, 2, eraspos, eras ? no_eras[0] : 0);
+   seg[0].p += 1;
+   seg[1].p += 24;
+   if(eras) memcpy(eraspos, eras[1], sizeof(eraspos));
+   res1 = decodersc_frame(seg, 2, eraspos, eras ? no_eras[1] : 0);
    if (res<0L || res1<0L) return -1L;
    else return res+res1;
-   return 0;
 } /* end reedsolomon41() */
 
 
@@ -324,11 +303,11 @@ static void posrs41(const byte b[], uint32_t b_len, uint32_t p)
    z = (double)getint32(b, b_len, p+8UL)*0.01;
    wgs84r(x, y, z, &lat, &long0, &heig);
    Serial.print(" ");
-   sonde.si()->lat = (float)(X2C_DIVL(lat,1.7453292519943E-2));
-   Serial.print(sonde.si()->lat);
+   sonde.rxsi()->lat = (float)(X2C_DIVL(lat,1.7453292519943E-2));
+   Serial.print(sonde.rxsi()->lat);
    Serial.print(" ");
-   sonde.si()->lon = (float)(X2C_DIVL(long0,1.7453292519943E-2));
-   Serial.print(sonde.si()->lon);
+   sonde.rxsi()->lon = (float)(X2C_DIVL(long0,1.7453292519943E-2));
+   Serial.print(sonde.rxsi()->lon);
    if (heig<1.E+5 && heig>(-1.E+5)) {
       Serial.print(" ");
       Serial.print((uint32_t)heig);
@@ -350,40 +329,90 @@ static void posrs41(const byte b[], uint32_t b_len, uint32_t p)
                 long0)+vz*(double)sin((float)lat);
    dir = X2C_DIVL(atang2(vn, ve),1.7453292519943E-2);
    if (dir<0.0) dir = 360.0+dir;
-   sonde.si()->dir = dir;
+   sonde.rxsi()->dir = dir;
    Serial.print(" ");
-   sonde.si()->hs = sqrt((float)(vn*vn+ve*ve))*3.6f;
-   Serial.print(sonde.si()->hs);
+   sonde.rxsi()->hs = sqrt((float)(vn*vn+ve*ve))*3.6f;
+   Serial.print(sonde.rxsi()->hs);
    Serial.print("km/h ");
    Serial.print(dir);
    Serial.print("deg ");
    Serial.print((float)vu);
-   sonde.si()->vs = vu;
+   sonde.rxsi()->vs = vu;
    Serial.print("m/s ");
    Serial.print(getcard16(b, b_len, p+18UL)&255UL);
    Serial.print("Sats");
-   sonde.si()->alt = heig;
+   sonde.rxsi()->alt = heig;
    if( 0==(int)(lat*10000) && 0==(int)(long0*10000) )
-      sonde.si()->validPos = 0;
+      sonde.rxsi()->validPos = 0;
    else
-      sonde.si()->validPos = 0x3f;
+      sonde.rxsi()->validPos = 0x3f;
 } /* end posrs41() */
 
 
 
-// returns: 0: ok, -1: rs or crc error
-int RS41::decode41(byte *data, int maxlen)
+// frame type byte (after header and RS parity): 0x0F for standard,
+// 0xF0 for long frames; decide by Hamming distance in case of bit errors
+#define RS41TYPEPOS 56
+// erasures per codeword: well below the 24 parity bytes, so that some errors
+// outside the unreliable ranges can still be corrected
+#define RS41MAXERAS_CW 16
+// bytes missing at the end of a frame that are still worth an erasure decoding attempt
+#define RS41MAXERAS (2*RS41MAXERAS_CW)
+static bool isLongFrame(uint8_t typ)
 {
-	char buf[128];	
-	int crcok = 0;
+	return __builtin_popcount(typ^0xF0) < __builtin_popcount(typ^0x0F);
+}
+
+// Position of frame byte p within its codeword (k: 0/1), -1 if not part of a codeword
+static int rs41CodewordPos(int p, uint32_t len2, int *k)
+{
+	if(p>=56 && p<=(int)(56+2*len2+1)) { *k = (p-56)&1; return 230-((p-56)>>1); }
+	if(p>=8 && p<56) { *k = (p-8)/24; return 254-(p-8)%24; }
+	return -1;
+}
 
-	int32_t corr = reedsolomon41(data, 560, 131);  // try short frame first
-	if(corr<0) {
-		corr = reedsolomon41(data, 560, 230);  // try long frame
+int RS41::correct41(uint8_t *data, const RXQuality *q)
+{
+	uint32_t len2 = isLongFrame(data[RS41TYPEPOS]) ? 230 : 131;
+	if(!q || q->nbad==0) return reedsolomon41(data, 560, len2);
+	// unreliable bytes (positions relative to payload, i.e. data+8) are erasures
+	uint32_t eras[2][24];
+	uint32_t no_eras[2] = { 0, 0 };
+	bool capped = false;
+	for(int i=0; i<q->nbad && !capped; i++) {
+		int to = q->badto[i] + 8;
+		if(to>RS41MAXLEN_LONG) to = RS41MAXLEN_LONG;
+		for(int p=q->badfrom[i]+8; p<to; p++) {
+			int k;
+			int pos = rs41CodewordPos(p, len2, &k);
+			if(pos<0) continue;
+			if(no_eras[k]>=RS41MAXERAS_CW) { capped = true; break; }
+			eras[k][no_eras[k]++] = pos;
+		}
+	}
+	if(!capped) {
+		int32_t res = reedsolomon41(data, 560, len2, eras, no_eras);
+		if(res>=0) return res;
 	}
+	// too many or wrong erasures (a codeword is only written back if decoded
+	// successfully): try again without them
+	return reedsolomon41(data, 560, len2);
+}
+
+// returns: 0: ok, -1: rs or crc error
+int RS41::decode41(byte *data, int maxlen, const RXQuality *q)
+{
+	int32_t corr = correct41(data, q);
 	Serial.print("RS result:");
 	Serial.print(corr);
 	Serial.println();
+	return parse41(data, maxlen);
+}
+
+int RS41::parse41(uint8_t *data, int maxlen)
+{
+	char buf[128];	
+	int crcok = 0;
 	int p = 57; // 8 byte header, 48 byte RS 
 	while(p<maxlen) {  /* why 555? */
 		uint8_t typ = data[p++];
@@ -419,10 +448,10 @@ int RS41::decode41(byte *data, int maxlen)
 			Serial.print("; RS41 ID ");
 			snprintf(buf, 10, "%.8s ", data+p+2);
 			Serial.print(buf);
-			sonde.si()->type=STYPE_RS41;
-			strncpy(sonde.si()->id, (const char *)(data+p+2), 8);
-			sonde.si()->id[8]=0;
-			sonde.si()->validID=true;
+			sonde.rxsi()->type=STYPE_RS41;
+			strncpy(sonde.rxsi()->id, (const char *)(data+p+2), 8);
+			sonde.rxsi()->id[8]=0;
+			sonde.rxsi()->validID=true;
 			}
 			// TODO: some more data
 			break;
@@ -459,15 +488,6 @@ void RS41::bitsToBytes(uint8_t *bits, uint8_t *bytes, int len)
 	bytes[(i-1)/8] &= 0x0F;
 }
 
-static unsigned char lookup[16] = {
-0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
-0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf, };
-
-static uint8_t reverse(uint8_t n) {
-   return (lookup[n&0x0f] << 4) | lookup[n>>4];
-}
-
-
 static uint8_t scramble[64] = {150U,131U,62U,81U,177U,73U,8U,152U,50U,5U,89U,
                 14U,249U,68U,198U,38U,33U,96U,194U,234U,121U,93U,109U,161U,
                 84U,105U,71U,12U,220U,232U,92U,241U,247U,118U,130U,127U,7U,
@@ -475,36 +495,60 @@ static uint8_t scramble[64] = {150U,131U,62U,81U,177U,73U,8U,152U,50U,5U,89U,
                 180U,182U,6U,170U,244U,35U,120U,110U,59U,174U,191U,123U,76U,
 		193U};
 
+static void Genscrambletab(void)
+{
+	for(int i=0; i<256; i++) {
+		uint8_t r = 0;
+		for(int j=0; j<8; j++) if(i&(1<<j)) r |= 0x80>>j;
+		revtab[i] = r;
+	}
+	for(int i=0; i<16; i++) {
+		scramble32[i] = scramble[4*i] | (scramble[4*i+1]<<8) |
+			(scramble[4*i+2]<<16) | ((uint32_t)scramble[4*i+3]<<24);
+	}
+}
+
+// Called by receivePacketTimeout during reception (data: frame without 8 byte
+// header), extends payload length as soon as the frame type byte is received
+static int frameLength41(const byte *data, int len) {
+	int p = RS41TYPEPOS-8;
+	if(len<=p) return 0;
+	uint8_t typ = revtab[data[p]] ^ scramble[RS41TYPEPOS&0x3F];
+	return isLongFrame(typ) ? RS41MAXLEN_LONG-8 : RS41MAXLEN-8;
+}
 
 int RS41::receive() {
 	sx1278.setPayloadLength(RS41MAXLEN-8); 
-	int e = sx1278.receivePacketTimeout(1000, data+8);
-	if(e) { Serial.println("TIMEOUT"); return RX_TIMEOUT; } 
+	int e = sx1278.receivePacketTimeout(1000, data+8, frameLength41);
+	const RXQuality *q = &sx1278.rxquality;
+	// an incomplete frame can still be corrected if the missing tail is
+	// small enough to be recovered as erasures
+	if(e && q->received < q->len-RS41MAXERAS) { Serial.println("TIMEOUT"); return RX_TIMEOUT; }
+
+	int len = sx1278.getPayloadLength()+8;
+	if(e) memset(data+8+q->received, 0, q->len-q->received);
+	descramble(data, len);
+	return decode41(data, len, q);
+}
 
-        for(int i=0; i<RS41MAXLEN; i++) { data[i] = reverse(data[i]); }
-        for(int i=0; i<RS41MAXLEN; i++) { data[i] = data[i] ^ scramble[i&0x3F]; }
-        return decode41(data, RS41MAXLEN);
+// Bit reverse and descramble data[from..len-1] in one pass, 4 bytes at a time
+// (from must be a multiple of 4)
+void RS41::descramble(uint8_t *data, int len, int from) {
+	int i = from;
+	if( ((uintptr_t)data&3)==0 ) {
+		uint32_t *w = (uint32_t *)data;
+		for(; i+4<=len; i+=4) {
+			const uint8_t *d = data+i;
+			w[i>>2] = ( revtab[d[0]] | (revtab[d[1]]<<8) | (revtab[d[2]]<<16) |
+				((uint32_t)revtab[d[3]]<<24) ) ^ scramble32[(i>>2)&15];
+		}
+	}
+	for(; i<len; i++) { data[i] = revtab[data[i]] ^ scramble[i&0x3F]; }
 }
 
 int RS41::waitRXcomplete() {
 	// Currently not used. can be used for additinoal post-processing
 	// (required for RS92 to avoid FIFO overrun in rx task)
-#if 0
-	int res;
-	uint32_t t0 = millis();
-	while(rxtask.receiveResult<0 && millis()-t0 < 3000) { delay(50); }
-
-	if(rxtask.receiveResult<0 || rxtask.receiveResult==RX_TIMEOUT) { 
-		res = RX_TIMEOUT;
-	} else if (rxtask.receiveResult==0) {
-		res = RX_OK;
-	} else {
-		res = RX_ERROR;
-	}
-	rxtask.receiveResult = -1;
-	Serial.printf("waitRXcomplete returning %d\n", res);
-	return res;
-#endif
 	return 0;
 }
 
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <Arduino.h>
+#include "SX1278FSK.h"
 #ifndef inttypes_h
         #include <inttypes.h>
 #endif
@@ -23,7 +24,7 @@ private:
 	uint32_t bits2val(const uint8_t *bits, int len);
 	void printRaw(uint8_t *data, int len);
 	void bitsToBytes(uint8_t *bits, uint8_t *bytes, int len);
-	int decode41(byte *data, int maxlen);
+	int decode41(byte *data, int maxlen, const RXQuality *q = NULL);
 
 #define B 8
 #define S 4
@@ -59,6 +60,15 @@ public:
 	int waitRXcomplete();
 	//int receiveFrame();
 
+	// Individual processing stages of receive(), also used by Bench.cpp
+	// de-whitening (bit reverse + descrambling) of data[from..len-1] of a received frame
+	void descramble(uint8_t *data, int len, int from = 0);
+	// Reed-Solomon correction, returns number of corrected bytes or -1
+	// q (optional): unreliable bytes reported by the radio, decoded as erasures
+	int correct41(uint8_t *data, const RXQuality *q = NULL);
+	// CRC check and decoding of all blocks, returns 0: ok, -1: crc error
+	int parse41(uint8_t *data, int maxlen);
+
 	int use_ecc = 1;
 };
 
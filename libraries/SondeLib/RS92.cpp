@@ -5,6 +5,7 @@
 #include "rsc.h"
 #include "Sonde.h"
 #include <SPIFFS.h>
+#include <stddef.h>
 
 // well...
 #include "rs92gps.h"
@@ -76,10 +77,74 @@ static void Gencrctab(void)
    } /* end for */
 } /* end Gencrctab() */
 
+// mantab[p][raw byte]: the 4 data bits of a raw byte (first received bit in bit 0),
+// p==1: data bits are raw bits 7,5,3,1 (MSB first), p==0: raw bits 6,4,2,0
+static uint8_t mantab[2][256];
 
-static byte data1[512]={0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x10};
-static byte data2[512]={0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x10};
-static byte *dataptr=data1;
+static void Genmantab(void)
+{
+	for(int b=0; b<256; b++) {
+		for(int p=0; p<2; p++) {
+			uint8_t v = 0;
+			for(int i=0; i<4; i++) {
+				v |= ((b >> (7-(1-p)-2*i)) & 1) << i;
+			}
+			mantab[p][b] = v;
+		}
+	}
+}
+
+
+/*
+ * Frame pool: frames are assembled by the RX task and decoded by the main loop
+ * in place, ownership of a slot is passed by its state:
+ * FREE -> FILLING (RX task, at sync) -> READY (RX task, after RS correction)
+ * -> DECODING (consumer, newFrame) -> FREE (consumer, releaseFrame)
+ * A slot that is FILLING when reception of a frame is aborted is reused at next sync.
+ */
+#define RS92FRAMELEN 240
+#define RS92_NSLOT 3
+enum { SLOT_FREE, SLOT_FILLING, SLOT_READY, SLOT_DECODING };
+typedef struct st_rs92slot {
+	byte data[RS92FRAMELEN];
+	volatile uint8_t state;
+	int corr;		// RS correction result
+	uint32_t seq;		// frame number, for delivering frames in order
+} RS92Slot;
+static RS92Slot slot[RS92_NSLOT];
+static RS92Slot *rxslot = NULL;		// slot currently being filled (RX task)
+static uint32_t rxseq = 0;
+static uint32_t slotdrops = 0;		// frames lost as no slot was free
+static byte *dataptr = NULL;
+
+static void initSlots(void)
+{
+	for(int i=0; i<RS92_NSLOT; i++) {
+		memcpy(slot[i].data, "\x2A\x2A\x2A\x2A\x2A\x10", 6);
+		slot[i].state = SLOT_FREE;
+	}
+	rxslot = NULL;
+}
+
+static RS92Slot *frameSlot(uint8_t *frame)
+{
+	return (RS92Slot *)(frame - offsetof(RS92Slot, data));
+}
+
+// RX task: get a slot for the next frame, NULL if all slots are in use
+static RS92Slot *fillSlot(void)
+{
+	if(rxslot) return rxslot;
+	for(int i=0; i<RS92_NSLOT; i++) {
+		if(slot[i].state==SLOT_FREE) {
+			rxslot = slot+i;
+			rxslot->state = SLOT_FILLING;
+			return rxslot;
+		}
+	}
+	slotdrops++;
+	return NULL;
+}
 
 static uint8_t rxbitc;
 static int32_t asynst[10]={0};
@@ -87,7 +152,6 @@ static uint16_t rxbyte;
 int rxp=0;
 
 static int haveNewFrame = 0;
-static int lastFrame = 0;
 static int headerDetected = 0;
 
 int RS92::setup(float frequency) 
@@ -97,6 +161,8 @@ int RS92::setup(float frequency)
 #endif
 	if(!initialized) {
 		Gencrctab();
+		Genmantab();
+		initSlots();
 		initrsc();
         	// not here for now.... get_eph("/brdc.19n");
 		initialized = true;
@@ -311,31 +377,18 @@ static void wgs84r(double x, double y, double z,
 #endif
 
 
+// codeword: data bytes buf[6+i] (i=209..0), parity bytes buf[216+i] (i=23..0)
 static int32_t reedsolomon92(uint8_t *buf, uint32_t buf_len)
 {  
-   uint32_t i;
-   int32_t res;
-   uint8_t b[256];
    uint32_t eraspos[24];
-   for (i = 0UL; i<=255UL; i++) {
-      b[i] = 0;
-   } /* end for */
-   for (i = 0UL; i<=209UL; i++) {
-      b[230UL-i] = buf[i+6UL];
-   } /* end for */
-   for (i = 0UL; i<=23UL; i++) {
-      b[254UL-i] = buf[i+216UL];
-   } /* end for */
-   res = decodersc((char *)b, eraspos, 0L);
-   if (res>0L && res<=12L) {
-      for (i = 0UL; i<=209UL; i++) {
-         buf[i+6UL] = b[230UL-i];
-      } /* end for */
-      for (i = 0UL; i<=23UL; i++) {
-         buf[i+216UL] = b[254UL-i];
-      } /* end for */
-   }
-   return res;
+   RSSeg seg[2];
+   seg[0].p = buf+6+209;
+   seg[0].n = 210;
+   seg[0].stride = -1;
+   seg[1].p = buf+216+23;
+   seg[1].n = 24;
+   seg[1].stride = -1;
+   return decodersc_frame(seg, 2, eraspos, 0);
 } /* end reedsolomon92() */
 
 void printRaw(uint8_t *data, int len)
@@ -359,9 +412,14 @@ void RS92::decodeframe92(uint8_t *data)
 	//int calok;
 	//int mesok;
 	//uint32_t calibok;
-	lastFrame = (dataptr==data1)?1:2;
-	Serial.printf("rs corr is %d --- data:%p data1:%p data2:%p lastframe=%d\n", corr, data, data1, data2, lastFrame);
-	dataptr = (dataptr==data1)?data2:data1;
+	// pass frame to consumer
+	lastCorr = corr;
+	rxslot->corr = corr;
+	rxslot->seq = rxseq++;
+	__sync_synchronize();	// frame must be complete before it is published
+	rxslot->state = SLOT_READY;
+	rxslot = NULL;
+	dataptr = NULL;
 	//print_frame(data, 240);
 #if 0
 	/* from sondemod*/
@@ -494,50 +552,109 @@ void RS92::stobyte92(uint8_t b)
 uint32_t rxdata;
 bool rxsearching=true;
 
+// 8N1 decoder state (after sync): decoded bits not yet stored (LSB first)
+static uint32_t rxacc;
+static int rxnacc;
+static uint8_t rxpar;		// 1: next raw bit is a data bit (second half of Manchester symbol)
+#define RS92SYNC 0x669AA9A9
 // search for
 // 101001100110011010011010011001100110100110101010100110101001
 // 1010011001100110100110100110 0110.0110 1001.1010 1010.1001 1010.1001 => 0x669AA9A9
+//
+// Each FIFO byte is processed as a whole: the sync word is searched at all 8
+// bit offsets, and after sync, mantab yields 4 decoded bits per byte. Only
+// bytes in which the sync word ends are processed partially.
 void RS92::process8N1data(uint8_t dt)
 {
-	for(int i=0; i<8; i++) {
-		uint8_t d = (dt&0x80)?1:0;
-		rxdata = (rxdata<<1) | d;
-		if((rxbitc&1)==1) { rxbyte = (rxbyte>>1) + (d<<9); } // mancester decoded data
-		dt <<= 1;
-		//
+	uint32_t prev = rxdata;
+	rxdata = (rxdata<<8) | dt;
+	int nbits = 8;		// unprocessed bits of dt (the lower nbits)
+	while(nbits>0) {
 		if(rxsearching) {
-			if(rxdata == 0x669AA9A9) {
-				rxsearching = false;
-				rxbitc = 0;
-				rxp = 6;
-                                int rssi=sx1278.getRSSI();
-                                int fei=sx1278.getFEI();
-                                int afc=sx1278.getAFC();
-                                Serial.print("Test: RSSI="); Serial.print(rssi);
-                                Serial.print(" FEI="); Serial.print(fei);
-                                Serial.print(" AFC="); Serial.println(afc);
-                                sonde.si()->rssi = rssi;
-                                sonde.si()->afc = afc;
+			// s: number of bits of dt following the sync word
+			int s;
+			for(s=nbits-1; s>=0; s--) {
+				if( ((prev<<(8-s)) | (dt>>s)) == RS92SYNC ) break;
 			}
+			if(s<0) return;
+			if(!fillSlot()) return;	// drop frame, continue searching
+			dataptr = rxslot->data;
+			rxsearching = false;
+			rxacc = 0;
+			rxnacc = 0;
+			rxpar = 0;
+			rxp = 6;
+			// signal at sync, printed by receive() once the frame is complete
+			sonde.rxsi()->rssi = sx1278.getRSSI();
+			sonde.rxsi()->afc = sx1278.getAFC();
+			nbits = s;
 		} else {
-			rxbitc = (rxbitc+1)%20;
-			if(rxbitc == 0) { // got startbit, 8 data bit, stop bit
-				//Serial.printf("%03x ",rxbyte);
-				dataptr[rxp++] = (rxbyte>>1)&0xff;
-				if(rxp==7 && dataptr[6] != 0x65) {
-					Serial.printf("wrong start: %02x\n",dataptr[6]);
-					rxsearching = true;
-				}
-				if(rxp>=240) {
-					rxsearching = true;
-					decodeframe92(dataptr);
-					haveNewFrame = 1;
-				}
-			}
+			nbits = decode8N1(dt, nbits);
 		}
 	}
 }
 
+// Manchester and 8N1 decoding of the lower nbits of dt
+// returns number of bits left if a frame ended within dt (sync search continues there)
+int RS92::decode8N1(uint8_t dt, int nbits)
+{
+	int first = rxpar ? 0 : 1;		// offset of first data bit
+	int n = (nbits - first + 1) >> 1;	// number of data bits
+	uint32_t bits;
+	if(nbits==8) {
+		bits = mantab[rxpar][dt];
+	} else {
+		bits = mantab[rxpar][(uint8_t)(dt<<(8-nbits))] & ((1<<n)-1);
+	}
+	rxpar ^= nbits&1;
+	rxacc |= bits << rxnacc;
+	rxnacc += n;
+	if(rxnacc < 10) return 0;
+	// got startbit, 8 data bit, stop bit
+	int stop = 9 - (rxnacc - n);		// index of stop bit within bits
+	uint8_t b = (rxacc>>1) & 0xff;
+	rxacc >>= 10;
+	rxnacc -= 10;
+	//Serial.printf("%02x ",b);
+	dataptr[rxp++] = b;
+	if(rxp==7 && dataptr[6] != 0x65) {
+		Serial.printf("wrong start: %02x\n",dataptr[6]);
+		rxsearching = true;
+	}
+	if(rxp>=240) {
+		rxsearching = true;
+		decodeframe92(dataptr);
+		haveNewFrame = 1;
+	}
+	if(!rxsearching) return 0;
+	return nbits - (first + 2*stop + 1);
+}
+
+void RS92::processData(const uint8_t *data, int len)
+{
+	for(int i=0; i<len; i++) { process8N1data(data[i]); }
+}
+
+uint8_t *RS92::newFrame(int *corr)
+{
+	RS92Slot *f = NULL;
+	for(int i=0; i<RS92_NSLOT; i++) {
+		if(slot[i].state==SLOT_READY && (!f || (int32_t)(slot[i].seq - f->seq) < 0)) f = slot+i;
+	}
+	if(!f) return NULL;
+	__sync_synchronize();
+	f->state = SLOT_DECODING;
+	if(corr) *corr = f->corr;
+	return f->data;
+}
+
+void RS92::releaseFrame(uint8_t *frame)
+{
+	RS92Slot *f = frameSlot(frame);
+	__sync_synchronize();	// frame must be read before the slot is reused
+	f->state = SLOT_FREE;
+}
+
 void process8N1dataOrig(uint8_t data)
 {
 	// data contains 8 bits (after mancester encoding; 4 real bit), big endian
@@ -570,26 +687,31 @@ void process8N1dataOrig(uint8_t data)
 	}
 }
 
+// raw FIFO data of one receive() call, for sx1278.captureFrame
+static uint8_t capbuf[1024];
+static int capn;
+
 int RS92::receive() {
 	unsigned long t0 = millis();
+	capn = 0;
 	Serial.printf("RS92::receive() start at %ld\n",t0);
    	while( millis() - t0 < 1000 ) {
-		uint8_t value = sx1278.readRegister(REG_IRQ_FLAGS2);
+		uint8_t value = sx1278.getFifoFlags();
 		if ( bitRead(value, 7) ) {
 			Serial.println("FIFO full");
       		}
-      		if ( bitRead(value, 4) ) {
-        		Serial.println("FIFO overflow");
-      		}
       		if ( bitRead(value, 2) == 1 ) {
         		Serial.println("FIFO: ready()");
         		sx1278.clearIRQFlags();
       		}
-		if(bitRead(value, 6) == 0) { // while FIFO not empty
-      			byte data = sx1278.readRegister(REG_FIFO);
-			//Serial.printf("%02x",data);
-      			process8N1data(data);
-      			value = sx1278.readRegister(REG_IRQ_FLAGS2);
+		if(bitRead(value, 5) == 1) { // at least one burst in FIFO
+			byte data[SX1278_FIFO_BURST];
+			sx1278.readFifo(data, SX1278_FIFO_BURST, value);
+			if(sx1278.isCapturing() && capn+SX1278_FIFO_BURST<=sizeof(capbuf)) {
+				memcpy(capbuf+capn, data, SX1278_FIFO_BURST);
+				capn += SX1278_FIFO_BURST;
+			}
+			processData(data, SX1278_FIFO_BURST);
     		} else {
 			if(headerDetected) {
 				t0 = millis(); // restart timer... don't time out if header detected...
@@ -597,21 +719,30 @@ int RS92::receive() {
 			}
     			if(haveNewFrame) {
 				Serial.printf("RS92::receive(): new frame complete after %ldms\n", millis()-t0);
+				Serial.printf("Test: RSSI=%d AFC=%d\n", sonde.rxsi()->rssi, sonde.rxsi()->afc);
 				haveNewFrame = 0;
+				sx1278.captureFrame(capbuf, capn);
 				return RX_OK;
 			}
-			delay(2);
+			sx1278.waitDIO(sx1278.fifoWait(100));
     		}
     	}
 	Serial.printf("RS92::receive() timed out\n");
+	sx1278.captureFrame(capbuf, capn);
     	return RX_TIMEOUT; // TODO RX_OK;
 }
 
 #define RS92MAXLEN (240)
 int RS92::waitRXcomplete() {
 	// called after complete...
-	Serial.printf("decoding frame %d\n", lastFrame);
-	print_frame(lastFrame==1?data1:data2, 240);
+	// decode newest frame, older ones (if decoding did not keep up) are skipped
+	int corr;
+	uint8_t *f = newFrame(&corr), *next;
+	if(!f) return 0;
+	while( (next=newFrame(&corr)) != NULL ) { releaseFrame(f); f = next; }
+	Serial.printf("decoding frame %d (%d dropped), rs corr is %d\n", frameSlot(f)->seq, slotdrops, corr);
+	print_frame(f, RS92FRAMELEN);
+	releaseFrame(f);
 
 	SondeInfo *si = sonde.sondeList+rxtask.receiveSonde;
 	si->lat = gpx.lat;
@@ -624,22 +755,6 @@ int RS92::waitRXcomplete() {
 	memcpy(si->id, gpx.id, 9);
 	si->validID = true;
 
-#if 0
-	int res=0;
-        uint32_t t0 = millis();
-        while( rxtask.receiveResult == 0xFFFF && millis()-t0 < 2000) { delay(20); }
-
-        if( rxtask.receiveResult<0 || rxtask.receiveResult==RX_TIMEOUT) {
-                res = RX_TIMEOUT;
-        } else if ( rxtask.receiveResult==0) {
-                res = RX_OK;
-        } else {
-                res = RX_ERROR;
-        }
-        rxtask.receiveResult = 0xFFFF;
-        Serial.printf("RS92::waitRXcomplete returning %d (%s)\n", res, RXstr[res]);
-        return res;
-#endif
 	return 0;
 }
 
@@ -682,8 +797,8 @@ int oldwaitRXcomplete() {
                                 Serial.print("Test: RSSI="); Serial.println(rssi);
                                 Serial.print("Test: FEI="); Serial.println(fei);
                                 Serial.print("Test: AFC="); Serial.println(afc);
-                                sonde.si()->rssi = rssi;
-                                sonde.si()->afc = afc;
+                                sonde.rxsi()->rssi = rssi;
+                                sonde.rxsi()->afc = afc;
                         }
                         if(di>520) {
                                 // TODO
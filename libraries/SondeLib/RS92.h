@@ -53,6 +53,7 @@ class RS92
 {
 private:
 	void process8N1data(uint8_t data);
+	int decode8N1(uint8_t data, int nbits);
 	void stobyte92(uint8_t byte);
         void decodeframe92(uint8_t *data);
 #if 0
@@ -88,6 +89,17 @@ public:
 	int receive();
 	int waitRXcomplete();
 
+	// Individual processing stages of receive(), also used by Bench.cpp
+	// process raw FIFO data (8N1 decoding, frame assembly, RS correction)
+	void processData(const uint8_t *data, int len);
+	// returns oldest complete frame not yet taken, NULL if none is available
+	// corr (if not NULL) is set to the RS correction result of that frame
+	// the frame is owned by the caller until it is passed to releaseFrame
+	uint8_t *newFrame(int *corr = NULL);
+	void releaseFrame(uint8_t *frame);
+	// RS correction result of the last frame received (RX task)
+	int lastCorr = 0;
+
 	int use_ecc = 1;
 };
 
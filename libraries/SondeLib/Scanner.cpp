@@ -5,23 +5,8 @@
 #include "Sonde.h"
 #include "Display.h"
 
-#define CHANBW 10
-#define PIXSAMPL (50/CHANBW)
 #define SMOOTH 3
-//#define STARTF 401000000
-#define NCHAN ((int)(6000/CHANBW))
 
-double STARTF = (sonde.config.startfreq * 1000000);
-//int CHANBW = (sonde.config.channelbw);
-//int NCHAN = ((int)(6000/CHANBW));
-//int PIXSAMPL = (50/CHANBW);
-
-int scanresult[NCHAN];
-int scandisp[NCHAN/PIXSAMPL];
-
-#define PLOT_N 128
-#define TICK1 (128/6)
-#define TICK2 (TICK1/4)
 //#define PLOT_MIN -250
 #define PLOT_MIN (sonde.config.noisefloor*2)
 #define PLOT_SCALE(x) (x<PLOT_MIN?0:(x-PLOT_MIN)/2)
@@ -36,19 +21,28 @@ void Scanner::fillTiles(uint8_t *row, int value) {
 	}
 }
 /*
- * There are 16*8 columns to plot, NPLOT must be lower than that
- * currently, we use 128 * 50kHz channels
+ * There are 16*8 columns to plot (PLOT_N), each pixel is the average of
+ * nchan/PLOT_N channels. Tick marks at each MHz and each 250 kHz.
  * There are 8*8 values to plot; MIN is bottom end, 
  */
 uint8_t tiles[16] = { 0x0f,0x0f,0x0f,0x0f,0xf0,0xf0,0xf0,0xf0, 1, 3, 7, 15, 31, 63, 127, 255};
-void Scanner::plotResult()
+void Scanner::plotResult(bool all)
 {
 	uint8_t row[8*8];
-	for(int i=0; i<PLOT_N; i+=8) {
+	int from = all ? 0 : dirtyFrom & ~7;
+	int to = all ? PLOT_N : dirtyTo;
+	dirtyFrom = PLOT_N;
+	dirtyTo = 0;
+	int tick1 = nchan * chanbw / 1000;	// MHz in sweep range
+	int tick2 = tick1 * 4;
+	disp.rdis->beginUpdate();
+	for(int i=from; i<to; i+=8) {
 		for(int j=0; j<8; j++) {
 			fillTiles(row+j, PLOT_SCALE(scandisp[i+j]));
-		        if( ((i+j)%TICK1)==0) { row[j] |= 0x07; }
-		        if( ((i+j)%TICK2)==0) { row[j] |= 0x01; }
+			// first pixel at or after a tick frequency
+			int p = i+j;
+			if( p==0 || (p*tick1)/PLOT_N != ((p-1)*tick1)/PLOT_N ) { row[j] |= 0x07; }
+			else if( (p*tick2)/PLOT_N != ((p-1)*tick2)/PLOT_N ) { row[j] |= 0x01; }
 		}
 		for(int y=0; y<8; y++) {
 			if(sonde.config.marker && y==1) {
@@ -58,63 +52,179 @@ void Scanner::plotResult()
 			disp.rdis->drawTile(i/8, y, 1, row+8*y);
 		}
 	}
+	disp.rdis->endUpdate();
 }
 
-void Scanner::scan()
+// FRF register value of channel
+uint32_t Scanner::frf(int chan) {
+	uint64_t f = startf + (uint64_t)1000 * chanbw * chan;
+	return (f << 19) / (uint64_t)SX127X_CRYSTAL_FREQ;
+}
+
+void Scanner::init()
 {
-#if 0
-	// Test only
-	for(int i=0; i<PLOT_N; i++) {
-		scandisp[i] = 30*sin(2*3.1415*i/50)-180;
+	chanbw = sonde.config.channelbw;
+	if(chanbw<1) chanbw = 10;
+	int range = sonde.config.scanrange;
+	if(range<1) range = 6;
+	nchan = range * 1000 / chanbw;
+	if(nchan>SCAN_MAXCHAN) {
+		Serial.printf("Scanner: %d channels, limited to %d\n", nchan, SCAN_MAXCHAN);
+		nchan = SCAN_MAXCHAN;
 	}
-	return;
-#endif
+	startf = sonde.config.startfreq * 1000000;
+	// TS_HOP (20us) + TS_RSSI ( 2^(SMOOTH+1) / 4 / CHANBW us)
+	settle = 20 + 1000*(1<<(SMOOTH+1))/4/chanbw + 5;
+	pos = 0;
+	pass = 0;
+	npeaks = 0;
+	dirtyFrom = PLOT_N;
+	dirtyTo = 0;
+	for(int i=0; i<nchan; i++) scanresult[i] = -255;
+	for(int i=0; i<PLOT_N; i++) scandisp[i] = -255;
+
 	// Configure 
 	sx1278.writeRegister(REG_PLL_HOP, 0x80);   // FastHopOn
-	sx1278.setRxBandwidth(CHANBW*1000);
+	sx1278.setRxBandwidth(chanbw*1000);
 	sx1278.writeRegister(REG_RSSI_CONFIG, SMOOTH&0x07);
-	sx1278.setFrequency(STARTF);
+	sx1278.setFrequency(startf);
 	sx1278.writeRegister(REG_OP_MODE, FSK_RX_MODE);
 	delay(20);
+	Serial.printf("Scanner: %d channels of %d kHz from %d Hz, %d us per channel\n", nchan, chanbw, startf, settle);
+}
+
+// recalculate pixels covering channels [from, to)
+void Scanner::updateDisplay(int from, int to)
+{
+	// pixels whose channel range [c0,c1) starts before to; with less channels
+	// than pixels a channel covers several pixels, up to PLOT_N for the last one
+	int p0 = from * PLOT_N / nchan;
+	int p1 = (to * PLOT_N + nchan - 1) / nchan;
+	if(p1>PLOT_N) p1 = PLOT_N;
+	for(int p=p0; p<p1; p++) {
+		int c0 = p * nchan / PLOT_N;
+		int c1 = (p+1) * nchan / PLOT_N;
+		if(c1<=c0) c1 = c0+1;	// less channels than pixels
+		int sum = 0;
+		for(int c=c0; c<c1; c++) sum += scanresult[c];
+		scandisp[p] = sum / (c1-c0);
+	}
+	if(p0<dirtyFrom) dirtyFrom = p0;
+	if(p1>dirtyTo) dirtyTo = p1;
+}
+
+/*
+ * Peak detection over scanresult[] after a complete sweep
+ *  - noise floor: median of all channels (histogram, RSSI register is 0..255)
+ *  - a signal starts PEAK_ON above the noise floor and ends when it drops
+ *    below PEAK_OFF (hysteresis against noise around the threshold)
+ *  - signals less than PEAK_MERGE kHz apart are one signal (sidebands of one
+ *    sonde with narrow channels), wider than PEAK_MAXWIDTH kHz are no sonde
+ *  - center frequency is the power weighted mean of the channels
+ */
+#define PEAK_ON 16		// 8 dB
+#define PEAK_OFF 8		// 4 dB
+#define PEAK_MERGE 20
+#define PEAK_MAXWIDTH 100
+#define PEAK_RASTER 0.01	// sondes use a 10 kHz raster
+
+void Scanner::findPeaks()
+{
+	uint16_t hist[256];
+	memset(hist, 0, sizeof(hist));
+	for(int i=0; i<nchan; i++) hist[-scanresult[i] & 0xFF]++;
+	int sum = 0, h = 0;
+	while(h<255 && (sum += hist[h]) < (nchan+1)/2) h++;
+	noise = -h;
+	int on = noise + PEAK_ON;
+	int off = noise + PEAK_OFF;
+	int merge = PEAK_MERGE / chanbw;
+	int maxwidth = PEAK_MAXWIDTH / chanbw;
 
-	unsigned long start = millis();
-	uint32_t lastfrf=-1;
-	for(int iter=0; iter<2; iter++) {   // two interations, to catch all RS41 transmissions
-	    for(int i=0; i<NCHAN; i++) {
-		float freq = STARTF + 1000.0*i*CHANBW;
-		uint32_t frf = freq * 1.0 * (1<<19) / SX127X_CRYSTAL_FREQ;
-		if( (lastfrf>>16)!=(frf>>16) ) {
-        		sx1278.writeRegister(REG_FRF_MSB, (frf&0xff0000)>>16);
+	npeaks = 0;
+	int i = 0;
+	while(i<nchan) {
+		if(scanresult[i] < on) { i++; continue; }
+		// extend to both sides while above the lower threshold, merging close signals
+		int first = i;
+		while(first>0 && scanresult[first-1] >= off) first--;
+		int last = i, gap = 0;
+		for(int j=i+1; j<nchan; j++) {
+			if(scanresult[j] >= off) { last = j; gap = 0; }
+			else if(++gap > merge) break;
 		}
-		if( ((lastfrf&0x00ff00)>>8) != ((frf&0x00ff00)>>8) ) {
-        		sx1278.writeRegister(REG_FRF_MID, (frf&0x00ff00)>>8);
+		i = last + 1;
+		int width = last - first + 1;
+		if(width > maxwidth) continue;
+		int32_t wsum = 0, max = -255;
+		float fsum = 0;
+		for(int j=first; j<=last; j++) {
+			int w = scanresult[j] - off;
+			if(w<=0) continue;
+			wsum += w;
+			fsum += (float)w * j;
+			if(scanresult[j] > max) max = scanresult[j];
 		}
-        	sx1278.writeRegister(REG_FRF_LSB, (frf&0x0000ff));
-		lastfrf = frf;
-		// Wait TS_HOP (20us) + TS_RSSI ( 2^(SMOOTH+1) / 4 / CHANBW us)
-		int wait = 20 + 1000*(1<<(SMOOTH+1))/4/CHANBW;
-		delayMicroseconds(wait+5);
+		float freq = (startf + 1000.0 * chanbw * fsum / wsum) / 1000000;
+		freq = PEAK_RASTER * (int)(freq / PEAK_RASTER + 0.5);
+		// insert sorted by rssi, drop weakest if full
+		int k = npeaks < SCAN_MAXPEAKS ? npeaks++ : SCAN_MAXPEAKS;
+		if(k==SCAN_MAXPEAKS && max <= peaks[k-1].rssi) continue;
+		if(k==SCAN_MAXPEAKS) k--;
+		while(k>0 && peaks[k-1].rssi < max) { peaks[k] = peaks[k-1]; k--; }
+		peaks[k].freq = freq;
+		peaks[k].rssi = max;
+		peaks[k].width = width;
+	}
+	for(int p=0; p<npeaks; p++) {
+		Serial.printf("Peak %d: %.3f MHz, %d dBm, %d channels\n", p, peaks[p].freq, peaks[p].rssi/2, peaks[p].width);
+	}
+}
+
+bool Scanner::scanSlice(int n)
+{
+	if(nchan==0) init();
+	if(pos==0 && pass==0) sweepStart = millis();
+	int first = pos;
+	int last = pos+n < nchan ? pos+n : nchan;
+	// hop to first channel; afterwards, the next hop is done directly after reading
+	// the RSSI, the next FRF value is calculated while the RSSI settles
+	sx1278.setFrf(frf(pos));
+	unsigned long t = micros();
+	for(; pos<last; pos++) {
+		uint32_t nextfrf = pos+1<last ? frf(pos+1) : 0;
+		while((long)(micros()-t) < settle) ;
 		int rssi = -(int)sx1278.readRegister(REG_RSSI_VALUE_FSK);
-		if(iter==0) { scanresult[i] = rssi; } else {
-			if(rssi>scanresult[i]) scanresult[i]=rssi;
+		if(nextfrf) {
+			sx1278.setFrf(nextfrf);
+			t = micros();
 		}
-	    }
+		if(pass==0 || rssi>scanresult[pos]) scanresult[pos] = rssi;
 	}
-	unsigned long duration = millis()-start;
-	Serial.print("Scan time: ");
-	Serial.println(duration);
-	for(int i=0; i<NCHAN; i+=PIXSAMPL) {
-		scandisp[i/PIXSAMPL]=scanresult[i];
-		for(int j=1; j<PIXSAMPL; j++) { scandisp[i/PIXSAMPL]+=scanresult[i+j]; }
-		//for(int j=1; j<PIXSAMPL; j++) { if(scanresult[i+j]>scandisp[i/PIXSAMPL]) scandisp[i/PIXSAMPL] = scanresult[i+j]; }
-		Serial.print(scanresult[i]); Serial.print(", ");
-	}
-	Serial.println("\n");
-	for(int i=0; i<NCHAN/PIXSAMPL; i++) { 
-		scandisp[i]/=PIXSAMPL;
-                Serial.print(scandisp[i]); Serial.print(", ");
+	updateDisplay(first, last);
+	if(pos<nchan) return false;
+	pos = 0;
+	if(++pass<SCAN_PASSES) return false;
+	pass = 0;
+	sweepTime = millis() - sweepStart;
+	unsigned long t0 = micros();
+	findPeaks();
+	peakTime = micros() - t0;
+	Serial.printf("Scan time: %d ms, peak detection: %d us (%d peaks, noise %d)\n", sweepTime, peakTime, npeaks, noise);
+	return true;
+}
+
+void Scanner::scan()
+{
+#if 0
+	// Test only
+	for(int i=0; i<PLOT_N; i++) {
+		scandisp[i] = 30*sin(2*3.1415*i/50)-180;
 	}
-	Serial.println("\n");
+	return;
+#endif
+	init();
+	while(!scanSlice(nchan)) ;
 }
 
 Scanner scanner = Scanner();
@@ -10,14 +10,56 @@
         #include <inttypes.h>
 #endif
 
+#define SCAN_MAXCHAN 1200	// e.g. 6 MHz with 5 kHz channels
+#define SCAN_PASSES 2		// two iterations, to catch all RS41 transmissions
+#define SCAN_SLICE 64		// channels per scanSlice() call from the main loop (about 30ms)
+#define PLOT_N 128
+#define SCAN_MAXPEAKS 8
+
+// Signal found in the last sweep
+typedef struct st_scanpeak {
+	float freq;		// center frequency [MHz], on a 10 kHz raster
+	int16_t rssi;		// max RSSI (-2*dBm)
+	int16_t width;		// number of channels
+} ScanPeak;
+
 class Scanner
 {
 private:
 	void fillTiles(uint8_t *row, int value);
+	uint32_t frf(int chan);
+	void updateDisplay(int from, int to);
+	void findPeaks();
+
+	int nchan;		// number of channels of current sweep
+	int chanbw;		// channel bandwidth [kHz]
+	uint32_t startf;	// frequency of first channel [Hz]
+	int settle;		// time after hop until RSSI is valid [us]
+	int pos;		// next channel to measure
+	int pass;
+	int dirtyFrom, dirtyTo;	// pixels changed since last plotResult
+	unsigned long sweepStart;
 
 public:	
-	void plotResult();
+	int16_t scanresult[SCAN_MAXCHAN];	// max RSSI of each channel (-2*dBm)
+	int scandisp[PLOT_N];			// average RSSI of channels in each pixel
+	uint32_t sweepTime;			// duration of last complete sweep [ms]
+	// peak detection, updated after each complete sweep
+	ScanPeak peaks[SCAN_MAXPEAKS];		// strongest first
+	int npeaks;
+	int noise;				// noise floor estimate (-2*dBm)
+	uint32_t peakTime;			// duration of last peak detection [us]
+
+	// Configure radio and sweep from sonde.config (startfreq, scanrange, channelbw)
+	void init();
+	int getChannels() { return nchan; }
+	float getFrequency(int chan) { return startf + 1000.0 * chanbw * chan; }
+	// Measure next n channels, returns true if a sweep (all passes) was completed
+	bool scanSlice(int n = SCAN_SLICE);
+	// Complete sweep
 	void scan(void);
+	// Draw pixels changed since last call (all=true: complete plot)
+	void plotResult(bool all = true);
 };
 
 extern Scanner scanner;
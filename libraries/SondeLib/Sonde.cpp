@@ -10,7 +10,8 @@
 
 extern SX1278FSK sx1278;
 
-RXTask rxtask = { -1, -1, -1, 0xFFFF, 0 };
+RXTask rxtask = { -1, -1, -1, 0 };
+RXQueue rxqueue;
 
 const char *evstring[]={"NONE", "KEY1S", "KEY1D", "KEY1M", "KEY1L", "KEY2S", "KEY2D", "KEY2M", "KEY2L",
                                "VIEWTO", "RXTO", "NORXTO", "(max)"};
@@ -26,13 +27,68 @@ int getKeyPressEvent(); /* in RX_FSK.ino */
  *    setup function.  Setup will update the value currentSonde.
  *  - Periodically it calls Sonde::receive(), which calls the current decoder's receive()
  *    function. It should return control to the SX1278 main loop at least once per second.
- *    It will also set the internal variable receiveResult.  The decoder's receive function
+ *    Decoders write decoded data to rxsi() only. After each receive(), the result and a
+ *    snapshot of rxsi() is put into rxqueue.  The decoder's receive function
  *    must make sure that there are no FIFI overflows in the SX1278.
- *  - the Arduino main loop will call the waitRXcomplete function, which should return as
- *    soon as there is some new data to display, or no later than after 1s, returning the
- *    value of receiveResult (or timeout, if receiveResult was not set within 1s). It
- *    should also return immediately if there is some keyboard input.
- */   
+ *  - the Arduino main loop will call the waitRXcomplete function, which sleeps until
+ *    there is a record in rxqueue, or no later than after 2s, copies the decoded data to
+ *    sondeList and returns the result (or timeout, if there was no record within 2s).
+ */
+
+bool RXQueue::push(const RXFrame *f) {
+	uint32_t h = head;
+	if(h - tail >= RXQUEUE_LEN) { dropped++; return false; }
+	frame[h%RXQUEUE_LEN] = *f;
+	__sync_synchronize();	// record must be complete before it is published
+	head = h + 1;
+	TaskHandle_t c = consumer;
+	if(c) xTaskNotifyGive(c);
+	return true;
+}
+
+bool RXQueue::pop(RXFrame *f) {
+	uint32_t t = tail;
+	if(t == head) return false;
+	__sync_synchronize();
+	*f = frame[t%RXQUEUE_LEN];
+	__sync_synchronize();	// slot must be read before it is released
+	tail = t + 1;
+	return true;
+}
+
+void RXQueue::wait(uint32_t ms) {
+	consumer = xTaskGetCurrentTaskHandle();
+	if(!empty() || rssiseq != rssiread) return;
+	ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+}
+
+void RXQueue::pushRSSI(uint8_t sonde, int rssi, int32_t afc) {
+	uint32_t s = rssiseq;
+	rssiseq = s + 1;
+	__sync_synchronize();
+	rssisonde = sonde;
+	rssival = rssi;
+	afcval = afc;
+	__sync_synchronize();
+	rssiseq = s + 2;
+	TaskHandle_t c = consumer;
+	if(c) xTaskNotifyGive(c);
+}
+
+bool RXQueue::popRSSI(uint8_t *sonde, int *rssi, int32_t *afc) {
+	uint32_t s = rssiseq;
+	// odd: update in progress, the producer notifies us when it is done
+	if(s == rssiread || (s&1)) return false;
+	__sync_synchronize();
+	*sonde = rssisonde;
+	*rssi = rssival;
+	*afc = afcval;
+	__sync_synchronize();
+	if(rssiseq != s) return false;	// overwritten while reading, take the next one
+	rssiread = s;
+	return true;
+}
+
 int initlevels[40];
 
 Sonde::Sonde() {
@@ -44,12 +100,21 @@ Sonde::Sonde() {
   	}
 	sondeList = (SondeInfo *)malloc((MAXSONDE+1)*sizeof(SondeInfo));
 	memset(sondeList, 0, (MAXSONDE+1)*sizeof(SondeInfo));
+	schedList = (SchedInfo *)malloc((MAXSONDE+1)*sizeof(SchedInfo));
+	memset(schedList, 0, (MAXSONDE+1)*sizeof(SchedInfo));
+	rxList = (SondeInfo *)malloc((MAXSONDE+1)*sizeof(SondeInfo));
+	memset(rxList, 0, (MAXSONDE+1)*sizeof(SondeInfo));
 	config.touch_thresh = 70;
 	config.led_pout = 9;	
 	// Try autodetecting board type
   	// Seems like on startup, GPIO4 is 1 on v1 boards, 0 on v2.1 boards?
 	config.gps_rxd = -1;
 	config.gps_txd = -1;
+	// DIO0 is connected on all TTGO LoRa32 and T-Beam boards, DIO1 (GPIO33)
+	// only on some of them; DIO2 (GPIO32) is left free as it is also touch input T9
+	config.sx1278_dio0 = 26;
+	config.sx1278_dio1 = -1;
+	config.sx1278_dio2 = -1;
 	config.oled_rst = 16;
 	config.disptype = 0;
 	if(initlevels[16]==0) {
@@ -103,11 +168,16 @@ Sonde::Sonde() {
 	config.display=1;
 	config.startfreq=400;
 	config.channelbw=10;
+	config.scanrange=6;
 	config.spectrum=10;
 	config.timer=0;
 	config.marker=0;
 	config.showafc=0;
 	config.freqofs=0;
+	config.capture=0;
+	config.bench=0;
+	config.sched=0;
+	config.detecttime=10000;
 	config.rs41.agcbw=12500;
 	config.rs41.rxbw=6300;
 	config.rs92.rxbw=12500;
@@ -186,6 +256,8 @@ void Sonde::setConfig(const char *cfg) {
 		config.startfreq = atoi(val);
 	} else if(strcmp(cfg,"channelbw")==0) {
 		config.channelbw = atoi(val);	
+	} else if(strcmp(cfg,"scanrange")==0) {
+		config.scanrange = atoi(val);
 	} else if(strcmp(cfg,"spectrum")==0) {
 		config.spectrum = atoi(val);
 	} else if(strcmp(cfg,"timer")==0) {
@@ -196,6 +268,20 @@ void Sonde::setConfig(const char *cfg) {
 		config.showafc = atoi(val);
 	} else if(strcmp(cfg,"freqofs")==0) {
 		config.freqofs = atoi(val);
+	} else if(strcmp(cfg,"sx1278_dio0")==0) {
+		config.sx1278_dio0 = atoi(val);
+	} else if(strcmp(cfg,"sx1278_dio1")==0) {
+		config.sx1278_dio1 = atoi(val);
+	} else if(strcmp(cfg,"sx1278_dio2")==0) {
+		config.sx1278_dio2 = atoi(val);
+	} else if(strcmp(cfg,"capture")==0) {
+		config.capture = atoi(val);
+	} else if(strcmp(cfg,"bench")==0) {
+		config.bench = atoi(val);
+	} else if(strcmp(cfg,"sched")==0) {
+		config.sched = atoi(val);
+	} else if(strcmp(cfg,"detecttime")==0) {
+		config.detecttime = atoi(val);
 	} else if(strcmp(cfg,"rs41.agcbw")==0) {
 		config.rs41.agcbw = atoi(val);
 	} else if(strcmp(cfg,"rs41.rxbw")==0) {
@@ -248,7 +334,7 @@ void Sonde::setIP(const char *ip, bool AP) {
 void Sonde::clearSonde() {
 	nSonde = 0;
 }
-void Sonde::addSonde(float frequency, SondeType type, int active, char *launchsite)  {
+void Sonde::addSonde(float frequency, SondeType type, int active, char *launchsite, int prio)  {
 	if(nSonde>=config.maxsonde) {
 		Serial.println("Cannot add another sonde, MAXSONDE reached");
 		return;
@@ -259,9 +345,60 @@ void Sonde::addSonde(float frequency, SondeType type, int active, char *launchsi
 	sondeList[nSonde].active = active;
 	strncpy(sondeList[nSonde].launchsite, launchsite, 17);	
 	memcpy(sondeList[nSonde].rxStat, "\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3\x3", 18); // unknown/undefined
+	sondeList[nSonde].prio = prio<1 ? 1 : prio>9 ? 9 : prio;
+	sondeList[nSonde].autodetect = false;
+	sondeList[nSonde].temp = false;
 	nSonde++;
 }
 
+int Sonde::addCandidate(float frequency, float tol) {
+	for(int i=0; i<nSonde; i++) {
+		if(fabs(sondeList[i].freq - frequency) <= tol) return i;
+	}
+	if(nSonde>=config.maxsonde) return -1;
+	addSonde(frequency, STYPE_RS41, 1, (char *)"Scan");
+	sondeList[nSonde-1].autodetect = true;
+	sondeList[nSonde-1].temp = true;
+	sondeList[nSonde-1].validID = false;
+	return nSonde-1;
+}
+
+// new index of channel i after clearCandidates, 0 if it has been removed
+static int remapIndex(const int8_t *map, int n, int i) {
+	return i<0 || i>=n || map[i]<0 ? 0 : map[i];
+}
+
+void Sonde::clearCandidates() {
+	// results still queued refer to the old indices
+	RXFrame f;
+	while(rxqueue.pop(&f)) applyRX(&f);
+	uint8_t rs;
+	int rssi;
+	int32_t afc;
+	if(rxqueue.popRSSI(&rs, &rssi, &afc)) {
+		sondeList[rs].rssi = rssi;
+		sondeList[rs].afc = afc;
+	}
+	// compact all lists, map[old index] = new index or -1 if removed
+	int8_t map[MAXSONDE+1];
+	int n = 0;
+	for(int i=0; i<nSonde; i++) {
+		if(sondeList[i].temp && !sondeList[i].validID) { map[i] = -1; continue; }
+		if(n!=i) {
+			sondeList[n] = sondeList[i];
+			schedList[n] = schedList[i];
+			rxList[n] = rxList[i];
+		}
+		map[i] = n++;
+	}
+	currentSonde = remapIndex(map, nSonde, currentSonde);
+	rxtask.currentSonde = remapIndex(map, nSonde, rxtask.currentSonde);
+	rxtask.receiveSonde = remapIndex(map, nSonde, rxtask.receiveSonde);
+	rxIndex = remapIndex(map, nSonde, rxIndex);
+	dfm.remapChannels(map, nSonde);
+	nSonde = n;
+}
+
 // called by updateState (only)
 void Sonde::nextConfig() {
 	currentSonde++;
@@ -289,10 +426,240 @@ void Sonde::nextRxSonde() {
 	}
 	Serial.printf("nextRxSonde: %d\n", rxtask.currentSonde);
 }
+
+/* Time-division scheduler (config.sched=1), called by the RX task after each receive().
+ * All supported sondes transmit one frame per second, and receive() returns after
+ * each frame (or after about one second without frame), so switching channels right
+ * after a result does not cut a frame of the channel we leave.
+ *  - Channels with a frame within SCHED_LOST ms are "in flight" and get a dwell time
+ *    of prio*SCHED_DWELL. They are left early after SCHED_MAXMISS missed frames.
+ *  - Other channels are only probed for SCHED_PROBE (a bit more than one frame period).
+ *  - The next channel is the one with the highest prio * time since last visit,
+ *    channels in flight count up to SCHED_GAIN times more, depending on their RX_OK rate.
+ * Within the dwell time, scheduleHop() uses the gaps between the frames: the frame
+ * phase of each channel is known from the sync word timestamp, so after a frame the
+ * receiver can hop (FastHop, no decoder setup) to another channel of the same type
+ * in flight and receive its next frame.
+ * The scheduler state is kept in schedList, which only the RX task uses; it reads the
+ * channel configuration (active, type, freq, prio) from sondeList.
+ */
+#define SCHED_PROBE 1500
+#define SCHED_DWELL 5000
+#define SCHED_LOST 30000
+#define SCHED_MAXMISS 3
+#define SCHED_GAIN 16
+#define SCHED_PERIOD 1000	// frame period of all supported sondes
+#define SCHED_GUARD 30		// retune at least this long before the expected sync word
+
+SchedInfo *Sonde::schedInfo(int i) {
+	SchedInfo *s = &schedList[i];
+	if(s->freq != sondeList[i].freq) {
+		memset(s, 0, sizeof(SchedInfo));
+		s->freq = sondeList[i].freq;
+	}
+	return s;
+}
+
+void Sonde::selectRx(int i) {
+	SondeInfo *s = &rxList[i];
+	if(s->freq != sondeList[i].freq) {
+		memset(s, 0, sizeof(SondeInfo));
+		s->freq = sondeList[i].freq;
+		s->type = sondeList[i].type;
+		s->autodetect = sondeList[i].autodetect;
+	} else if(!sondeList[i].autodetect) {
+		s->type = sondeList[i].type;
+		s->autodetect = false;
+	}
+	s->active = sondeList[i].active;
+	rxIndex = i;
+}
+
+static bool inFlight(SchedInfo *s, uint32_t now) {
+	return s->lastOK != 0 && now - s->lastOK < SCHED_LOST;
+}
+
+int Sonde::schedule(int cur, uint8_t res) {
+	uint32_t now = millis();
+	SchedInfo *si = schedInfo(cur);
+	si->okRate = si->okRate - (si->okRate>>2) + (res==RX_OK ? 64 : 0);
+	if(res==RX_OK) {
+		si->lastOK = now;
+		if(sx1278.syncTime) si->lastSync = sx1278.syncTime;
+		schedMiss = 0;
+	} else {
+		schedMiss++;
+	}
+	bool flying = inFlight(si, now);
+	uint32_t dwell = flying ? sondeList[cur].prio * SCHED_DWELL : SCHED_PROBE;
+	if(now - schedStart < dwell && !(flying && schedMiss >= SCHED_MAXMISS)) return -1;
+
+	int best = -1;
+	uint32_t bestscore = 0;
+	for(int i=0; i<nSonde; i++) {
+		if(!sondeList[i].active || i==cur) continue;
+		SchedInfo *s = schedInfo(i);
+		uint32_t age = (now - s->lastVisit)/100;	// 0.1s units, at most 1h
+		if(age > 36000) age = 36000;
+		uint32_t score = (age + 1) * sondeList[i].prio;
+		if(inFlight(s, now)) score += score * (SCHED_GAIN-1) * s->okRate / 256;
+		if(score > bestscore) { bestscore = score; best = i; }
+	}
+	si->lastVisit = now;
+	if(best<0) {	// only one active channel
+		schedStart = now;
+		schedMiss = 0;
+		return -1;
+	}
+	Serial.printf("schedule: leaving %d after %d ms (ok rate %d), next %d\n", cur,
+		now - schedStart, si->okRate, best);
+	return best;
+}
+
+// time until the next expected sync word of s, at least SCHED_GUARD
+static uint32_t nextSync(SchedInfo *s, uint32_t now) {
+	uint32_t phase = (now + SCHED_GUARD - s->lastSync) % SCHED_PERIOD;
+	return SCHED_GUARD + (SCHED_PERIOD - phase) % SCHED_PERIOD;
+}
+
+int Sonde::scheduleHop(int cur) {
+	uint32_t now = millis();
+	// hop only while the current channel is in flight, else schedule() finds the next one
+	if(!inFlight(schedInfo(cur), now)) return -1;
+	int best = -1;
+	int bestscore = 0;
+	for(int i=0; i<nSonde; i++) {
+		if(!sondeList[i].active || sondeList[i].autodetect || sondeList[i].type!=sondeList[cur].type) continue;
+		SchedInfo *s = schedInfo(i);
+		if(s->lastSync==0 || !inFlight(s, now)) continue;
+		// longest without frame first (capped, so that a lost sonde does not dominate),
+		// but prefer frames that come soon
+		uint32_t age = now - s->lastSync;
+		if(age > 3*SCHED_PERIOD) age = 3*SCHED_PERIOD;
+		int score = age * sondeList[i].prio - nextSync(s, now);
+		if(best<0 || score>bestscore) { bestscore = score; best = i; }
+	}
+	if(best==cur) return -1;
+	return best;
+}
 SondeInfo *Sonde::si() {
 	return &sondeList[currentSonde];
 }
 
+void Sonde::setupDecoder(SondeType type, float freq) {
+	switch(type) {
+	case STYPE_RS41:
+		rs41.setup(freq * 1000000);
+		break;
+	case STYPE_DFM06:
+	case STYPE_DFM09:
+		dfm.setup(freq * 1000000, type==STYPE_DFM06?0:1 );
+		break;
+	case STYPE_RS92:
+		rs92.setup(freq * 1000000);
+	}
+}
+
+/* Sonde type autodetection (qrg.txt type 'A'), called by receive() in the RX task.
+ * The SX1278 can only look for one sync word at a time, so the decoder
+ * configurations (sync word, bit rate, manchester) are tried one after the
+ * other. Each call listens for one DETECT_SLOT (longer than the frame period
+ * of all types) and scores the sync address matches, the radio is restarted
+ * after each match. The state is kept per channel in schedList, so detection
+ * continues where it stopped when the scheduler comes back to the channel.
+ * The first type reaching DETECT_LOCK matches, or after config.detecttime of
+ * listening the best type with at least one match, becomes the candidate.
+ * Sync matches alone are not reliable (the RS92 sync word is a single byte), so
+ * the candidate is only locked on after its decoder has received a frame that
+ * passes the CRC/RS/Hamming check, within DETECT_CONFIRM attempts. Otherwise its
+ * score is cleared and the search continues; without any match, start over.
+ */
+#define DETECT_SLOT 1100
+#define DETECT_LOCK 2
+#define DETECT_CONFIRM 3
+static const SondeType detectOrder[] = { STYPE_RS41, STYPE_DFM09, STYPE_DFM06, STYPE_RS92 };
+#define DETECT_N ((int)(sizeof(detectOrder)/sizeof(detectOrder[0])))
+
+// receive one frame with the decoder of the given type, true if it is valid
+static bool detectConfirm(SondeType type) {
+	switch(type) {
+	case STYPE_RS41:
+		return rs41.receive()==RX_OK;
+	case STYPE_DFM06:
+	case STYPE_DFM09:
+		return dfm.receive()==RX_OK && dfm.lastCorr>=0;
+	case STYPE_RS92:
+		return rs92.receive()==RX_OK && rs92.lastCorr>=0;
+	}
+	return false;
+}
+
+int Sonde::detectType() {
+	SondeInfo *rx = rxsi();
+	SchedInfo *d = schedInfo(rxIndex);
+	if(d->detectSlots==0) {
+		// start with the type from qrg.txt
+		memset(d->detectScore, 0, sizeof(d->detectScore));
+		d->detectStep = 0;
+		for(int i=0; i<DETECT_N; i++) if(detectOrder[i]==rx->type) d->detectStep = i;
+		d->detectCand = -1;
+		d->detectStart = millis();
+	}
+	if(d->detectCand>=0) {
+		SondeType cand = (SondeType)d->detectCand;
+		setupDecoder(cand, rx->freq);
+		if(detectConfirm(cand)) {
+			detectTime = millis() - d->detectStart;
+			Serial.printf("autodetect: locked on %s (score %d) after %d ms\n", sondeTypeStr[cand], d->detectScore[cand], detectTime);
+			d->detectSlots = 0;
+			return cand;
+		}
+		if(++d->detectTries >= DETECT_CONFIRM) {
+			Serial.printf("autodetect: %s not confirmed by a valid frame\n", sondeTypeStr[cand]);
+			d->detectScore[cand] = 0;
+			d->detectCand = -1;
+		}
+		return -1;
+	}
+	SondeType type = detectOrder[d->detectStep];
+	setupDecoder(type, rx->freq);
+	sx1278.clearIRQFlags();
+	sx1278.writeRegister(REG_OP_MODE, FSK_RX_MODE);
+	uint32_t t0 = millis();
+	while(millis()-t0 < DETECT_SLOT && d->detectScore[type] < DETECT_LOCK && rxtask.activate==-1) {
+		if(sx1278.readRegister(REG_IRQ_FLAGS1) & 0x01) {	// SyncAddressMatch
+			d->detectScore[type]++;
+			sx1278.clearIRQFlags();	// restart RX, drop payload
+		}
+		delay(2);
+	}
+	d->detectSlots++;
+	uint32_t listened = d->detectSlots * DETECT_SLOT;
+	Serial.printf("autodetect: %s score %d after %d ms\n", sondeTypeStr[type], d->detectScore[type], millis() - d->detectStart);
+	int best = -1;
+	if(d->detectScore[type] >= DETECT_LOCK) {
+		best = type;
+	} else if(listened >= config.detecttime) {
+		for(int i=0; i<DETECT_N; i++) {
+			SondeType t = detectOrder[i];
+			if(d->detectScore[t]>0 && (best<0 || d->detectScore[t]>d->detectScore[best])) best = t;
+		}
+		if(best<0) {
+			Serial.printf("autodetect: no sync on %f after %d ms\n", rx->freq, millis() - d->detectStart);
+			d->detectSlots = 0;
+			return -1;
+		}
+	} else {
+		d->detectStep = (d->detectStep+1) % DETECT_N;
+		return -1;
+	}
+	// candidate: confirmed by a decoded frame on the next calls
+	Serial.printf("autodetect: candidate %s (score %d)\n", sondeTypeStr[best], d->detectScore[best]);
+	d->detectCand = best;
+	d->detectTries = 0;
+	return -1;
+}
+
 void Sonde::setup() {
 	if(rxtask.currentSonde<0 || rxtask.currentSonde>=config.maxsonde) {
 		Serial.print("Invalid rxtask.currentSonde: ");
@@ -303,16 +670,18 @@ void Sonde::setup() {
 	// update receiver config
 	Serial.print("\nSonde::setup() on sonde index ");
 	Serial.println(rxtask.currentSonde);
-	switch(sondeList[rxtask.currentSonde].type) {
-	case STYPE_RS41:
-		rs41.setup(sondeList[rxtask.currentSonde].freq * 1000000);
-		break;
-	case STYPE_DFM06:
-	case STYPE_DFM09:
-		dfm.setup( sondeList[rxtask.currentSonde].freq * 1000000, sondeList[rxtask.currentSonde].type==STYPE_DFM06?0:1 );
-		break;
-	case STYPE_RS92:
-		rs92.setup( sondeList[rxtask.currentSonde].freq * 1000000);
+	// decoders continue with data already known for this sonde
+	selectRx(rxtask.currentSonde);
+	sx1278.syncTime = 0;
+	schedStart = millis();
+	schedMiss = 0;
+	// with unknown type, receive() runs the autodetection first
+	if(!rxsi()->autodetect)
+		setupDecoder(rxsi()->type, rxsi()->freq);
+	if(config.capture) {
+		// one replay file per decoder, used by the benchmark (see Bench.h)
+		static const char *capfile[] = { "/spiffs/dfm.rec", "/spiffs/dfm.rec", "/spiffs/rs41.rec", "/spiffs/rs92.rec" };
+		sx1278.startCapture(capfile[rxsi()->type]);
 	}
 	// debug
 	float afcbw = sx1278.getAFCBandwidth();
@@ -322,8 +691,21 @@ void Sonde::setup() {
 
 void Sonde::receive() {
 	uint16_t res = 0;
-	SondeInfo *si = &sondeList[rxtask.currentSonde];
-	switch(si->type) {
+	int hop = -1;
+	// channel of this frame, rxtask.currentSonde may change below
+	int cur = rxtask.currentSonde;
+	SondeInfo *si = &sondeList[cur];
+	SondeInfo *rx = rxsi();
+	if(rx->autodetect) {
+		// the main loop takes the detected type from the RXFrame
+		int type = detectType();
+		if(type>=0) {
+			rx->type = (SondeType)type;
+			rx->autodetect = false;
+			setupDecoder(rx->type, rx->freq);
+		}
+		res = RX_TIMEOUT;
+	} else switch(rx->type) {
 	case STYPE_RS41:
 		res = rs41.receive();
 		break;
@@ -353,11 +735,24 @@ void Sonde::receive() {
 
 	// we should handle timer events here, because after returning from receive,
 	// we'll directly enter setup
-	rxtask.receiveSonde = rxtask.currentSonde; // pass info about decoded sonde to main loop
-
 	int event = getKeyPressEvent();
 	if (!event) event = timeoutEvent(si);
 	int action = (event==EVT_NONE) ? ACT_NONE : disp.layout->actions[event];
+	if(config.sched) {
+		// timers do not change the channel, the scheduler does (keys still do)
+		if(action==ACT_NEXTSONDE && event>=EVT_VIEWTO) action = ACT_NONE;
+		int next = schedule(cur, res&0xff);
+		if(next>=0 && action==ACT_NONE) {
+			// only the RX task is retuned (setup() on the next channel), the
+			// display stays on its sonde as with hops
+			rxtask.currentSonde = next;
+			if(rxtask.activate==-1) rxtask.activate = ACT_SONDE(next);
+		} else if(next<0 && action==ACT_NONE) {
+			hop = scheduleHop(cur);
+		}
+		// keys move on from the sonde shown, not from the channel being received
+		if(action==ACT_NEXTSONDE || action==ACT_PREVSONDE) rxtask.currentSonde = currentSonde;
+	}
 	Serial.printf("event %x: action is %x\n", event, action);
 	// If action is to move to a different sonde index, we do update things here, set activate
 	// to force the sx1278 task to call sonde.setup(), and pass information about sonde to
@@ -373,29 +768,94 @@ void Sonde::receive() {
 	}
 	res = (action<<8) | (res&0xff);
 	Serial.printf("receive Result is %04x\n", res);
-	// let waitRXcomplete resume...
-	rxtask.receiveResult = res;
+	// pass result and decoded data to waitRXcomplete
+	RXFrame f;
+	f.res = res;
+	f.sonde = cur;
+	f.rssi = rx->rssi;
+	f.afc = rx->afc;
+	memcpy(f.id, rx->id, sizeof(f.id));
+	f.validID = rx->validID;
+	f.lat = rx->lat;
+	f.lon = rx->lon;
+	f.alt = rx->alt;
+	f.vs = rx->vs;
+	f.hs = rx->hs;
+	f.dir = rx->dir;
+	f.validPos = rx->validPos;
+	f.type = rx->autodetect ? -1 : rx->type;
+	if(!rxqueue.push(&f)) Serial.printf("rxqueue full, frame dropped (%d)\n", rxqueue.dropped);
+
+	if(hop>=0) {
+		// same decoder, only the frequency changes; the display stays where it is.
+		// The dwell time (schedStart) covers all channels visited by hops, so
+		// hopping does not starve the other channels.
+		uint32_t now = millis();
+		Serial.printf("schedule: hop %d -> %d, next frame in %d ms\n", cur, hop,
+			nextSync(schedInfo(hop), now));
+		schedInfo(cur)->lastVisit = now;
+		rxtask.currentSonde = hop;
+		selectRx(hop);
+		sx1278.fastHop(sondeList[hop].freq * 1000000);
+		sx1278.syncTime = 0;
+		schedMiss = 0;
+	}
+}
+
+void Sonde::postRSSI(int rssi, int32_t afc) {
+	rxsi()->rssi = rssi;
+	rxsi()->afc = afc;
+	rxqueue.pushRSSI(rxtask.currentSonde, rssi, afc);
+}
+
+// copy decoded data of an RXFrame to sondeList (main loop)
+void Sonde::applyRX(const RXFrame *f) {
+	SondeInfo *si = &sondeList[f->sonde];
+	si->rssi = f->rssi;
+	si->afc = f->afc;
+	memcpy(si->id, f->id, sizeof(si->id));
+	si->validID = f->validID;
+	si->lat = f->lat;
+	si->lon = f->lon;
+	si->alt = f->alt;
+	si->vs = f->vs;
+	si->hs = f->hs;
+	si->dir = f->dir;
+	si->validPos = f->validPos;
+	if(si->autodetect && f->type>=0) {
+		Serial.printf("autodetect: channel %d is %s\n", f->sonde, sondeTypeStr[f->type]);
+		si->type = (SondeType)f->type;
+		si->autodetect = false;
+	}
 }
 
 // return (action<<8) | (rxresult)
 uint16_t Sonde::waitRXcomplete() {
-	uint16_t res=0;
+	uint16_t res = RX_TIMEOUT;
+	RXFrame f;
         uint32_t t0 = millis();
-rxloop:
-        while( rxtask.receiveResult==0xFFFF && millis()-t0 < 2000) { delay(50); }
-	if( rxtask.receiveResult == RX_UPDATERSSI ) {
-		Serial.println("RSSI update");
-		rxtask.receiveResult = 0xFFFF;
-		disp.updateDisplayRSSI();
-		goto rxloop;
-	}
-
-	if( rxtask.receiveResult==0xFFFF) {
-		res = RX_TIMEOUT;
-	} else {
-		res = rxtask.receiveResult;
+	while(1) {
+		uint8_t rs;
+		int rssi;
+		int32_t afc;
+		if(rxqueue.popRSSI(&rs, &rssi, &afc)) {
+			Serial.println("RSSI update");
+			sondeList[rs].rssi = rssi;
+			sondeList[rs].afc = afc;
+			if(rs == currentSonde) disp.updateDisplayRSSI();
+			continue;
+		}
+		if(!rxqueue.pop(&f)) {
+			uint32_t t = millis()-t0;
+			if(t >= 2000) break;
+			rxqueue.wait(2000-t);
+			continue;
+		}
+		applyRX(&f);
+		rxtask.receiveSonde = f.sonde;
+		res = f.res;
+		break;
 	}
-        rxtask.receiveResult = 0xFFFF;
 	/// TODO: THis has caused an exception when swithcing back to spectrumm...
         Serial.printf("waitRXcomplete returning %04x (%s)\n", res, (res&0xff)<4?RXstr[res&0xff]:"");
 	// currently used only by RS92
@@ -416,6 +876,11 @@ rxloop:
 	return res;
 }
 
+// true if another result is already waiting in rxqueue
+bool Sonde::rxPending() {
+	return !rxqueue.empty();
+}
+
 uint8_t Sonde::timeoutEvent(SondeInfo *si) {
 	uint32_t now = millis();
 #if 1
@@ -526,6 +991,7 @@ void Sonde::updateDisplay()
 
 void Sonde::clearDisplay() {
 	disp.rdis->clear();
+	disp.invalidate();
 }
 
 Sonde sonde = Sonde();
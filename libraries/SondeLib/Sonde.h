@@ -8,7 +8,6 @@
 // RX_ERROR: header detected, but data not decoded (crc error, etc.)
 // RX_OK: header and data ok
 enum RxResult { RX_OK, RX_TIMEOUT, RX_ERROR, RX_UNKNOWN, RX_NOPOS };
-#define RX_UPDATERSSI 0xFFFE
 
 // Events that change what is displayed (mode, sondenr)
 // Keys:
@@ -57,10 +56,8 @@ typedef struct st_RXTask {
 	// and currently received sonde
 	int mainState;
 	int currentSonde;
-	// Variable set by RXTask to communicate status to Arduino task
-	// via waitRXcomplete function
-	uint16_t receiveResult;
-	uint16_t receiveSonde;  // sonde inde corresponding to receiveResult
+	// Sonde index of the last frame taken from rxqueue by waitRXcomplete
+	uint16_t receiveSonde;
 	// status variabe set by decoder to indicate something is broken
 	// int fifoOverflow;
 } RXTask;
@@ -93,12 +90,16 @@ typedef struct st_rdzconfig {
 	int tft_cs;			// TFT CS pin
 	int gps_rxd;			// GPS module RXD pin. We expect 9600 baud NMEA data.
 	int gps_txd;			// GPS module TXD pin
+	int sx1278_dio0;		// GPIO connected to SX1278 DIO0 (-1: not connected)
+	int sx1278_dio1;		// GPIO connected to SX1278 DIO1
+	int sx1278_dio2;		// GPIO connected to SX1278 DIO2
 	int debug;				// show port and config options after reboot
 	int wifi;				// connect to known WLAN 0=skip
 	int wifiap;				// enable/disable WiFi AccessPoint mode 0=disable
 	int display;			// select display mode (0=default, 1=default, 2=fieldmode)
 	int startfreq;			// spectrum display start freq (400, 401, ...)
 	int channelbw;			// spectrum channel bandwidth (valid: 5, 10, 20, 25, 50, 100 kHz)	
+	int scanrange;			// spectrum display range in MHz (default 6)
 	int spectrum;			// show freq spectrum for n seconds 0=disable
 	int timer;				// show remaining time in spectrum  0=disable
 	int marker;				// show freq marker in spectrum  0=disable
@@ -107,6 +108,10 @@ typedef struct st_rdzconfig {
 	int noisefloor;			// for spectrum display
 	int showafc;			// show afc value in rx screen
 	int freqofs;			// frequency offset (tuner config = rx frequency + freqofs) in Hz
+	int capture;			// record received frames to /spiffs/<type>.rec 0=disable
+	int bench;			// run decoder benchmark with recorded frames at startup 0=disable
+	int sched;			// time-division scheduling of all active channels 0=disable
+	int detecttime;			// time budget for sonde type autodetection (ms)
 	char call[9];			// APRS callsign
 	char passcode[9];		// APRS passcode
 	struct st_rs41config rs41;	// configuration options specific for RS41 receiver
@@ -144,12 +149,80 @@ typedef struct st_sondeinfo {
 	uint32_t norxStart;		// millis() timestamp of continuous no rx start
 	uint32_t viewStart;		// millis() timestamp of viewinf this sonde with current display
 	int8_t lastState;		// -1: disabled; 0: norx; 1: rx
+	uint8_t prio;			// scheduler priority 1..9 (qrg.txt)
+	bool autodetect;		// type unknown (qrg.txt type 'A'), detected by the RX task
+	bool temp;			// added by the spectrum peak detector, not in qrg.txt
 } SondeInfo;
 // rxStat: 3=undef[empty] 1=timeout[.] 2=errro[E] 3=ok[1] 5=no valid position[°]
 
 
 #define MAXSONDE 99
 
+// Scheduler (config.sched) and type autodetection state of a channel, owned by the RX task
+typedef struct st_schedinfo {
+	float freq;			// channel frequency this state belongs to
+	uint16_t okRate;		// average rate of RX_OK, 0..256
+	uint32_t lastOK;		// millis() timestamp of last RX_OK (0: never)
+	uint32_t lastVisit;		// millis() timestamp of last time the RX task left this channel
+	uint32_t lastSync;		// millis() timestamp of sync word of last RX_OK frame (frame phase)
+	// autodetection, continued on each visit of the channel
+	uint8_t detectStep;		// index into the order in which types are tried
+	uint8_t detectScore[STYPE_RS92+1];	// sync word matches per type
+	uint16_t detectSlots;		// listening slots so far
+	int8_t detectCand;		// type waiting for confirmation by a valid frame, -1 if none
+	uint8_t detectTries;		// frames received for the candidate so far
+	uint32_t detectStart;		// millis() timestamp of the first slot
+} SchedInfo;
+
+// Record passed from the RX task to the main loop after each receive()
+typedef struct st_rxframe {
+	uint16_t res;			// (action<<8) | RxResult
+	uint8_t sonde;			// sonde index
+	int rssi;
+	int32_t afc;
+	// decoded data (snapshot of RX task state)
+	char id[10];
+	bool validID;
+	float lat, lon, alt, vs, hs, dir;
+	uint8_t validPos;
+	int8_t type;			// SondeType found by autodetection, -1 if type not yet known
+} RXFrame;
+
+#define RXQUEUE_LEN 8	// power of 2
+
+// Lock-free queue with a single producer (RX task) and a single consumer (main loop)
+class RXQueue
+{
+public:
+	RXQueue() { head = tail = 0; dropped = 0; consumer = NULL; rssiseq = rssiread = 0; }
+	// producer: returns false (and drops f) if queue is full
+	bool push(const RXFrame *f);
+	// consumer: returns false if queue is empty
+	bool pop(RXFrame *f);
+	bool empty() { return head==tail; }
+	// consumer: sleep until next push or RSSI update (or at most ms milliseconds)
+	void wait(uint32_t ms);
+	// RSSI/AFC measured during reception: only the latest value is kept, so
+	// updates never fill the queue nor delay the frames behind them
+	void pushRSSI(uint8_t sonde, int rssi, int32_t afc);
+	// consumer: returns false if there is no new value
+	bool popRSSI(uint8_t *sonde, int *rssi, int32_t *afc);
+	uint32_t dropped;
+private:
+	RXFrame frame[RXQUEUE_LEN];
+	volatile uint32_t head;		// written by producer only
+	volatile uint32_t tail;		// written by consumer only
+	TaskHandle_t consumer;
+	// latest RSSI value, rssiseq is odd while the producer writes it
+	volatile uint32_t rssiseq;
+	uint32_t rssiread;		// consumer only
+	uint8_t rssisonde;
+	int rssival;
+	int32_t afcval;
+};
+
+extern RXQueue rxqueue;
+
 class Sonde
 {
 private:
@@ -160,19 +233,53 @@ public:
 	// moved to heap, saving space in .bss
 	//SondeInfo sondeList[MAXSONDE+1];
 	SondeInfo *sondeList;
+	// decoded data of all channels, only used by the RX task; decoders
+	// continue with the data of the channel the RX task (re)tunes to
+	SondeInfo *rxList;
+	// channel the decoders currently work on (rxsi())
+	int rxIndex = 0;
+	// scheduler state of all channels, only used by the RX task
+	SchedInfo *schedList;
+	// scheduler state of rxtask.currentSonde (RX task)
+	uint32_t schedStart;
+	int schedMiss;
+	// duration of the last successful type autodetection, from its first slot (ms)
+	uint32_t detectTime;
 
 	Sonde();
 	void setConfig(const char *str);
 
 	void clearSonde();
-	void addSonde(float frequency, SondeType type, int active, char *launchsite);
+	void addSonde(float frequency, SondeType type, int active, char *launchsite, int prio=1);
+	// add frequency found by spectrum scan (type autodetect) unless a channel
+	// within tol MHz exists; returns index of the new or existing channel, -1 if full
+	int addCandidate(float frequency, float tol);
+	// remove temporary channels without decoded sonde ID (only if RX task is inactive);
+	// queued results are applied first, channel indices are remapped
+	void clearCandidates();
 	void nextConfig();
 	void nextRxSonde();
+	// scheduler state of channel i (reset if the channel has been changed)
+	SchedInfo *schedInfo(int i);
+	// make channel i the one decoded into rxsi() (data reset if the channel has been changed);
+	// on autodetect channels, a type detected by the RX task is kept
+	void selectRx(int i);
+	// scheduler: returns index of next channel to receive, -1 to stay on channel cur
+	int schedule(int cur, uint8_t res);
+	// channel of same type whose next frame should be received in the gap, or -1
+	int scheduleHop(int cur);
+	// configure the decoder of the given type
+	void setupDecoder(SondeType type, float freq);
+	// autodetection on rxsi(): try the next sync word for one slot, returns the
+	// detected SondeType, or -1 if detection is not complete
+	int detectType();
 
 	/* new interface */
 	void setup();
 	void receive();
 	uint16_t waitRXcomplete();
+	void applyRX(const RXFrame *f);
+	bool rxPending();
 	/* old and temp interface */
 #if 0
 	void processRXbyte(uint8_t data);
@@ -180,6 +287,10 @@ public:
 #endif
 
 	SondeInfo *si();
+	// Sonde data currently decoded by RX task (use only in RX task)
+	SondeInfo *rxsi() { return &rxList[rxIndex]; }
+	// Pass RSSI/AFC measured during reception to main loop
+	void postRSSI(int rssi, int32_t afc);
 
 	uint8_t timeoutEvent(SondeInfo *si);
 	uint8_t updateState(uint8_t event);
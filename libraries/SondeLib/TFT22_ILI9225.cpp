@@ -398,6 +398,7 @@ void TFT22_ILI9225::begin()
 
 
 void TFT22_ILI9225::_spiWrite(uint8_t b) {
+    bytesSent++;
     if(_clk < 0){
         HSPI_WRITE(b);
         return;
@@ -420,6 +421,7 @@ void TFT22_ILI9225::_spiWrite16(uint16_t s)
     #ifdef HSPI_WRITE16
     if(_clk < 0){
         HSPI_WRITE16(s);
+        bytesSent += 2;
         return;
     }
     #endif
@@ -824,6 +826,7 @@ void TFT22_ILI9225::_writeData16(uint16_t data) {
 }
 */
 void TFT22_ILI9225::_writeCommand16(uint16_t command) {
+    bytesSent += 2;
     SPI_DC_LOW();
     SPI_CS_LOW();
     if ( _clk < 0 ) {
@@ -849,6 +852,7 @@ void TFT22_ILI9225::_writeCommand16(uint16_t command) {
 }
 
 void TFT22_ILI9225::_writeData16(uint16_t data) {
+    bytesSent += 2;
     SPI_DC_HIGH();
     SPI_CS_LOW();
     if ( _clk < 0 ) {
@@ -1195,6 +1199,7 @@ const uint16_t** bitmap, int16_t w, int16_t h) {
         #ifdef HSPI_WRITE_PIXELS
         if (_clk < 0) {
             HSPI_WRITE_PIXELS(bitmap[y], w * sizeof(uint16_t));
+            bytesSent += w * sizeof(uint16_t);
             continue;
         }
         #endif
@@ -1266,6 +1271,32 @@ uint16_t* bitmap, int16_t w, int16_t h) {
     endWrite();
 }
 
+void TFT22_ILI9225::beginPixels(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
+    _setWindow(x0, y0, x1, y1, L2R_TopDown);
+    startWrite();
+    SPI_DC_HIGH();
+    SPI_CS_LOW();
+}
+
+void TFT22_ILI9225::writePixels(uint16_t* pixels, uint32_t n) {
+    #ifdef HSPI_WRITE_PIXELS
+    if (_clk < 0) {
+        HSPI_WRITE_PIXELS(pixels, n * sizeof(uint16_t));
+        bytesSent += n * sizeof(uint16_t);
+        return;
+    }
+    #endif
+    for (uint32_t i = 0; i < n; ++i) {
+        _spiWrite16(pixels[i]);
+    }
+}
+
+void TFT22_ILI9225::endPixels(void) {
+    SPI_CS_HIGH();
+    endWrite();
+    _resetWindow();
+}
+
 void TFT22_ILI9225::startWrite(void){
     if (writeFunctionLevel++ == 0) {
         SPI_BEGIN_TRANSACTION();
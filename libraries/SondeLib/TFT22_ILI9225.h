@@ -362,6 +362,21 @@ class TFT22_ILI9225 {
         void drawBitmap(uint16_t x, uint16_t y, const uint16_t* bitmap, int16_t w, int16_t h);
         void drawBitmap(uint16_t x, uint16_t y, uint16_t* bitmap, int16_t w, int16_t h);
 
+        /// Stream pixels into a window: the window is set once by beginPixels,
+        /// followed by any number of writePixels calls (rows top down, left to right)
+        /// @param    x0 top left corner, x-axis
+        /// @param    y0 top left corner, y-axis
+        /// @param    x1 bottom right corner, x-axis
+        /// @param    y1 bottom right corner, y-axis
+        void beginPixels(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1);
+        /// @param    pixels 16bit colors
+        /// @param    n number of pixels
+        void writePixels(uint16_t* pixels, uint32_t n);
+        void endPixels(void);
+
+        /// Bytes sent to the panel (commands, addressing and pixel data), for statistics
+        uint32_t bytesSent = 0;
+
         /// Set current GFX font
         /// @param    f GFX font name defined in include file
         void setGFXFont(const GFXfont *f = NULL);
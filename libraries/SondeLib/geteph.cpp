@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <WiFi.h>
 #include "Display.h"
+#include "nav_gps_vel.h"
 
 
 extern WiFiClient client;
@@ -31,16 +32,115 @@ uint8_t getreply() {
 	return str[0];
 }
 
-void writeFully(File &file, uint8_t *buf, size_t len)
-{
-	size_t olen;
+// Read exactly len bytes (with stream timeout), returns false on end of stream
+static bool readFully(Stream &in, uint8_t *buf, size_t len) {
+	return in.readBytes((char *)buf, len) == len;
+}
 
-	while(len) {
-		olen = file.write(buf, len);
-		Serial.printf("written: %d of %d\n", olen, len);
-		len -= olen;
-		buf += olen;
+// Skip gzip header (RFC 1952), returns false if not a gzip stream
+static bool skipGzipHeader(Stream &in) {
+	uint8_t hdr[10];
+	if(!readFully(in, hdr, 10)) return false;
+	if(hdr[0]!=0x1f || hdr[1]!=0x8b || hdr[2]!=8) return false;
+	uint8_t flags = hdr[3];
+	if(flags&0x04) { // FEXTRA
+		if(!readFully(in, hdr, 2)) return false;
+		for(int n = hdr[0] | (hdr[1]<<8); n>0; n--) if(!readFully(in, hdr, 1)) return false;
+	}
+	for(int f=0x08; f<=0x10; f<<=1) { // FNAME, FCOMMENT: zero terminated
+		if(!(flags&f)) continue;
+		do {
+			if(!readFully(in, hdr, 1)) return false;
+		} while(*hdr);
+	}
+	if(flags&0x02) { // FHCRC
+		if(!readFully(in, hdr, 2)) return false;
 	}
+	return true;
+}
+
+#define GZ_INBUF 1024
+
+// Keep the last 8 bytes of all input in tail (gzip trailer at the end of the stream)
+static void keepTail(uint8_t *tail, const uint8_t *buf, size_t len) {
+	if(len>=8) { memcpy(tail, buf+len-8, 8); return; }
+	memmove(tail, tail+len, 8-len);
+	memcpy(tail+8-len, buf, len);
+}
+
+// Inflate a gzip stream (FTP data connection or file) and parse the RINEX content on the fly.
+// Only the resulting binary ephemeris file is written to flash (replaced only on success).
+// RAM: decompressor state, 32k dictionary/output ring, GZ_INBUF input buffer.
+// Returns number of ephemerides written, or -1 on error
+int gunzipRNX(Stream &in, const char *binfile) {
+	in.setTimeout(5000);  // tolerate stalls of the data connection
+	if(!skipGzipHeader(in)) {
+		Serial.println("gunzipRNX: invalid gzip header");
+		return -1;
+	}
+	tinfl_decompressor *decomp = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+	uint8_t *obuf = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+	uint8_t *ibuf = (uint8_t *)malloc(GZ_INBUF);
+	RNX_t *rnx = (RNX_t *)calloc(1, sizeof(RNX_t));
+	int result = -1;
+	bool ok = false;
+	uint32_t total = 0;
+	if(!decomp || !obuf || !ibuf || !rnx || RNX_init(rnx)<0) {
+		Serial.println("gunzipRNX: out of memory");
+		goto out;
+	}
+	if(EPHbin_begin(rnx, binfile)<0) goto out;
+	tinfl_init(decomp);
+	{
+		size_t inlen = 0, inofs = 0, opos = 0;
+		mz_ulong crc = MZ_CRC32_INIT;
+		uint8_t tail[8] = { 0 };
+		bool eof = false;
+		tinfl_status res;
+		do {
+			if(inlen==0 && !eof) {
+				inlen = in.readBytes((char *)ibuf, GZ_INBUF);
+				inofs = 0;
+				if(inlen==0) eof = true;
+				keepTail(tail, ibuf, inlen);
+			}
+			size_t ilen = inlen;
+			size_t olen = TINFL_LZ_DICT_SIZE - opos;
+			res = tinfl_decompress(decomp, ibuf+inofs, &ilen, obuf, obuf+opos, &olen,
+					eof ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+			inofs += ilen;
+			inlen -= ilen;
+			RNX_feed(rnx, (const char *)obuf+opos, olen);
+			crc = mz_crc32(crc, obuf+opos, olen);
+			total += olen;
+			opos = (opos + olen) & (TINFL_LZ_DICT_SIZE-1);
+		} while(res>TINFL_STATUS_DONE && !(eof && res==TINFL_STATUS_NEEDS_MORE_INPUT));
+		Serial.printf("gunzipRNX: status %d, decompressed %d bytes, %d records\n", res, total, rnx->count);
+		if(res!=TINFL_STATUS_DONE) goto out;
+		// gzip trailer: CRC32 and size (mod 2^32) of the uncompressed data in the
+		// last 8 bytes of the stream (tinfl may already have read some of them ahead)
+		in.setTimeout(200);
+		while(!eof) {
+			size_t n = in.readBytes((char *)ibuf, GZ_INBUF);
+			if(n==0) eof = true;
+			keepTail(tail, ibuf, n);
+		}
+		uint32_t tcrc = tail[0] | (tail[1]<<8) | (tail[2]<<16) | ((uint32_t)tail[3]<<24);
+		uint32_t tsize = tail[4] | (tail[5]<<8) | (tail[6]<<16) | ((uint32_t)tail[7]<<24);
+		if(tcrc!=(uint32_t)crc || tsize!=total) {
+			Serial.printf("gunzipRNX: gzip trailer mismatch (crc %08x/%08x, size %d/%d)\n",
+				tcrc, (uint32_t)crc, tsize, total);
+			goto out;
+		}
+		ok = RNX_result(rnx) != NULL;
+	}
+out:
+	if(rnx) result = EPHbin_end(rnx, total, ok);
+	free(rnx);
+	free(ibuf);
+	free(obuf);
+	free(decomp);
+	return result;
 }
 
 void geteph() {
@@ -76,11 +176,6 @@ void geteph() {
 	disp.rdis->setFont(FONT_SMALL);
 	disp.rdis->drawString(0, 0, "FTP ngs.noaa.gov");
 	// fetch rinex from server
-	File fh = SPIFFS.open("/brdc.gz","w");
-	if(!fh) {	
-		Serial.println("cannot open file\n");
-		return;
-	}
 	char buf[252];
 	snprintf(buf, 128, "/cors/rinex/%04d/%03d/brdc%03d0.%02dn.gz", year, day, day, year-2000);
 	Serial.println("running geteph\n");
@@ -133,94 +228,23 @@ void geteph() {
 	s = client.readStringUntil('\n');
 	Serial.println(s);
 	if(s.c_str()[0]>='4') { Serial.println("RETR failed"); return; }
-	int len=0;
-	while(dclient.connected()) {
-		while(dclient.available()) {
-			char c = dclient.read();
-			fh.write(c);
-			len++;
-		}
-	}
-	Serial.printf("fetched %d bytes\n", len);
-	fh.close();
-	snprintf(buf, 16, "Fetched %d B    ",len);
-	buf[16]=0;
-	disp.rdis->drawString(0,2,buf);
-
-	disp.rdis->drawString(0,4,"Decompressing...");
-	// decompression
-	tinfl_decompressor *decomp = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
-	tinfl_init(decomp);
-	File file = SPIFFS.open("/brdc.gz","r");
-	if(!file) {	
-		Serial.println("cannot open file\n");
+	disp.rdis->drawString(0,2,"Decompressing...");
+	// socket -> inflate -> RINEX parser -> /brdc.bin, no intermediate files
+	int n = gunzipRNX(dclient, "/brdc.bin");
+	dclient.stop();
+	if(n<0) {
+		disp.rdis->drawString(0,3,"Failed");
+		delay(1000);
 		return;
 	}
-	File ofile = SPIFFS.open("/brdc", "w");
-	if(!ofile) {
-		Serial.println("cannot open file /brdc for writing");
-		return;
-	}
-	file.readBytes(buf, 10);  // skip gzip header
-	char flags = buf[3];
-	if(flags&0x07) {
-		Serial.println("Unsupported flags in gzip header, may or may not cause a problem");
-	}
-	if(flags&0x08) { // skip file name extra header
-		do {
-			int res=file.readBytes(buf, 1);
-			if(res!=1) return;
-		} while(*buf);
-	}
-	if(flags&0x10) { // skip file name extra header
-		do {
-			int res=file.readBytes(buf, 1);
-			if(res!=1) return;
-		} while(*buf);
-	}
-	int opos = 0;
-	int total = 0;
-	Serial.println("Decompressing ephemeris data...\n");
-	char *obuf =(char *)malloc(32768);
-	char *ibuf =(char *)malloc(8192);
-	while(file.available()) {
-		size_t len = file.readBytes(ibuf, 8192);
-		size_t inofs = 0;
-		size_t inlen = len;
-		while(inofs<len) {
-			size_t outlen=32768-opos;
-			int res = tinfl_decompress(decomp, (const mz_uint8 *)ibuf+inofs, &inlen, (uint8_t *)obuf, (mz_uint8 *)obuf+opos, &outlen, TINFL_FLAG_HAS_MORE_INPUT);
-			if(res<0) break;
-			if(outlen==0) break;
-			Serial.printf("... (res=%d) decompressed %d into %d bytes\n", res, inlen, outlen);
-			inofs += inlen;
-			inlen = len - inofs;
-			//size_t retv = ofile.write((uint8_t *)(obuf+opos), outlen);
-			//Serial.printf("write %d bytes\n", retv);
-			writeFully(ofile, (uint8_t *)(obuf+opos), outlen);
-			//Serial.write((uint8_t *)(obuf+opos), outlen);
-			total += outlen;
-			opos += outlen;
-			if(res==0) break; // done indication
-			if(opos>=32768) {
-				Serial.printf("... decompressed %d bytes\n", total);
-				opos=0;
-			}
-		}
-	}
-	// maybe todo: check crc?!?
-	Serial.printf("done extracing content (total length: %d)\n", total);
+	// left over by old versions, would be converted again by get_eph
+	SPIFFS.remove("/brdc.gz");
+	SPIFFS.remove("/brdc");
 	status = SPIFFS.open("/brdc.time","w");
 	status.println(nowstr);
 	status.close();
-        snprintf(buf, 16, "Done: %d B    ",total);
-        buf[16]=0;
-        disp.rdis->drawString(0,5,buf);
+	snprintf(buf, 16, "Done: %d eph   ", n);
+	buf[16]=0;
+	disp.rdis->drawString(0,3,buf);
 	delay(1000);
-
-	free(obuf);
-	free(ibuf);
-	free(decomp);
-	file.close();
-	ofile.close();
 }
@@ -1,3 +1,6 @@
 
+#include <Arduino.h>
+
 void geteph();
+int gunzipRNX(Stream &in, const char *binfile);
 
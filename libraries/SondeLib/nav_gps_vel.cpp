@@ -246,167 +246,315 @@ int read_RNXephemeris(FILE *fp, EPHEM_t eph[][24]) {
 }
 #endif
 
-static EPHEM_t *te;
+#define WEEKSEC 604800
 
-#define fgets(buffer, siz, file) file.read((uint8_t *)buffer, siz)
-#define fread(buffer, siz, els, file) (file.read((uint8_t *)buffer, (siz)*(els))/siz)
-#define fgetc(file) (char)file.read()
+static EPHEM_t *te;     // te[1..n] records, te[n+1].prn = 0 (te[0] unused, see calc_satpos_rnx2)
 
+static EPHEM_t *te_alloc() {
+    // allocated once and reused, avoids heap fragmentation on reload
+    if (te == NULL) te = (EPHEM_t *)malloc( EPH_MAXREC * sizeof(EPHEM_t) );
+    if (te != NULL) memset(te, 0, EPH_MAXREC * sizeof(EPHEM_t));
+    return te;
+}
 
-//EPHEM_t *read_RNXpephs(FILE *fp) {
-EPHEM_t *read_RNXpephs(const char *file) {
-    int l, i;
-    //char buffer[86];
-    char buf[64], str[20];
-    unsigned ui;
-    double dbl;
-    int c;
-    EPHEM_t ephem = {};
-    // int count = 0;
-    //long fpos;
-
-    File fp = SPIFFS.open(file, "r");
-    if(!fp) { Serial.printf("Error opening %s\n", file); }
-
-    String line;
-    do {  // header-Zeilen: 80 Zeichen
-	line = fp.readStringUntil('\n');
-        //pbuf = fgets(buffer, 84, fp);   // max 82-1 Zeichen
-        //buffer[82] = '\0';
-	Serial.printf("Skipping header: %s\n", line.c_str());
-    } while ( fp.available()  &&  !strstr((const char *)line.c_str(), "END OF HEADER") );
-    if (!fp.available()) return NULL;
-/*
-    fpos = ftell(fp);
-    count = 0;
-    while (count >= 0) {  // data-Zeilen: 79 Zeichen
-        pbuf = fgets(buffer, 84, fp); if (pbuf == 0) break;
-        strncpy(str, buffer, 3);
-        str[3] = '\0';
-        sscanf(str, "%d", &ui);
-        if (ui < 33) count++;
-        for (i = 1; i < 8; i++) {
-            pbuf = fgets(buffer, 84, fp); if (pbuf == 0) break;
-        }
-    }
-    printf("Ephemerides: %d total=%d\n", count, count*sizeof(ephem));
-
-    fseek(fp, fpos, SEEK_SET);
-*/
-    if(te) free(te);
-    te = (EPHEM_t *)calloc( 34, sizeof(ephem) ); // calloc( 1, sizeof(ephem) );
-    if (te == NULL) return NULL;
+/* ---------------------------------------------------------------------------------------------------- */
+//
+// Compact binary ephemeris file: header, all records of the RINEX file in file order, trailer.
+// The trailer is written last and marks the file complete.
+// Fields with at most 24 significant bits in the broadcast message are stored as float
+// (toe, toc: multiples of 16s, exact).
+//
 
-    //int n = 0;
+#define EPHBIN_MAGIC   0x32485045    // "EPH2"
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t reclen;     // sizeof(EPHBIN_t)
+    uint16_t reserved;
+} EPHBIN_HDR_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t srclen;     // size of the RINEX file the records were converted from
+    uint32_t count;      // number of records
+} EPHBIN_TRL_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  prn;
+    uint8_t  health;
+    uint16_t gpsweek;
+    double   e, sqrta, M0, Omega0, i0, w, af0;
+    float    toe, toc, delta_n, OmegaDot, idot, tgd, af1, af2;
+    float    cuc, cus, crc, crs, cic, cis;
+} EPHBIN_t;
+
+static void ephbin_pack(const EPHEM_t *p, EPHBIN_t *r) {
+    r->prn = p->prn;  r->health = p->health;  r->gpsweek = p->gpsweek;
+    r->e = p->e;  r->sqrta = p->sqrta;  r->M0 = p->M0;  r->Omega0 = p->Omega0;
+    r->i0 = p->i0;  r->w = p->w;  r->af0 = p->af0;
+    r->toe = p->toe;  r->toc = p->toc;
+    r->delta_n = p->delta_n;  r->OmegaDot = p->OmegaDot;  r->idot = p->idot;
+    r->tgd = p->tgd;  r->af1 = p->af1;  r->af2 = p->af2;
+    r->cuc = p->cuc;  r->cus = p->cus;  r->crc = p->crc;  r->crs = p->crs;
+    r->cic = p->cic;  r->cis = p->cis;
+}
 
+static void ephbin_unpack(const EPHBIN_t *r, EPHEM_t *p) {
+    memset(p, 0, sizeof(EPHEM_t));
+    strcpy(p->epoch, "0000000000000000");
+    p->prn = r->prn;  p->health = r->health;  p->gpsweek = r->gpsweek;  p->week = 1;
+    p->e = r->e;  p->sqrta = r->sqrta;  p->M0 = r->M0;  p->Omega0 = r->Omega0;
+    p->i0 = r->i0;  p->w = r->w;  p->af0 = r->af0;
+    p->toe = r->toe;  p->toc = r->toc;
+    p->delta_n = r->delta_n;  p->OmegaDot = r->OmegaDot;  p->idot = r->idot;
+    p->tgd = r->tgd;  p->af1 = r->af1;  p->af2 = r->af2;
+    p->cuc = r->cuc;  p->cus = r->cus;  p->crc = r->crc;  p->crs = r->crs;
+    p->cic = r->cic;  p->cis = r->cis;
+}
 
-    while (true) {  // brdc/hour-rinex sollte nur Daten von einem Tag enthalten
+/* ---------------------------------------------------------------------------------------------------- */
+//
+// RINEX 2 navigation file parser, fed with arbitrary chunks of text (file or inflate output).
+// Keeps the most recent ephemeris per PRN (most recent data is at end of file),
+// all records go to the binary file if one is attached (EPHbin_begin).
+//
 
-        //memset(&ephem, 0, sizeof(ephem));
+int RNX_init(RNX_t *rnx) {
+    memset(rnx, 0, sizeof(RNX_t));
+    rnx->state = -1;
+    rnx->eph = te_alloc();
+    return rnx->eph ? 0 : -1;
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;  sscanf(buf, "%d", &ui);
-        ephem.prn = ui;
+// D19.12 field starting at col, missing or empty fields are 0
+static double rnxfield(const char *line, int len, int col) {
+    char f[20];
+    int i, n;
+    if (col >= len) return 0;
+    n = len-col < 19 ? len-col : 19;
+    for (i = 0; i < n; i++) {
+        f[i] = line[col+i];
+        if (f[i] == 'D' || f[i] == 'd') f[i] = 'E';
+    }
+    f[n] = 0;
+    return strtod(f, NULL);
+}
 
-        for (i = 0; i < 16; i++) ephem.epoch[i] = '0';
-        ephem.epoch[16] = '\0';
+// GPS time of week of the epoch "20yymmddhhmmss" (day of week: Sakamoto)
+static double rnxtow(const char *epoch, double sec) {
+    static const int mt[12] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+    int v[6];
+    for (int i = 0; i < 6; i++) v[i] = (epoch[2*i+2]-'0')*10 + epoch[2*i+3]-'0';
+    int y = 2000 + v[0], m = v[1], d = v[2];
+    if (m < 1 || m > 12) return 0;
+    if (m < 3) y--;
+    int dow = (y + y/4 - y/100 + y/400 + mt[m-1] + d) % 7;   // 0: sunday
+    return dow*86400.0 + v[3]*3600.0 + v[4]*60.0 + sec;
+}
 
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  buf[19] = 0;
+static void rnxline(RNX_t *rnx) {
+    const char *l = rnx->line;
+    int len = rnx->len;
+    EPHEM_t *e = &rnx->ephem;
+    double d[4];
+    int i;
 
-        for (i = 0; i < 6; i++) {
-            c = buf[3*i  ]; if (c == ' ') c = '0'; str[2*i  ] = c;
-            c = buf[3*i+1]; if (c == ' ') c = '0'; str[2*i+1] = c;
+    if (rnx->state < 0) {  // header
+        if (len >= 73 && strncmp(l+60, "END OF HEADER", 13) == 0) rnx->state = 0;
+        return;
+    }
+    if (len == 0) return;
+    if (rnx->state == 0) {
+        memset(e, 0, sizeof(EPHEM_t));
+        char prn[3] = { l[0], len > 1 ? l[1] : ' ', 0 };
+        e->prn = atoi(prn);
+        // "20yymmddhhmmss", vorausgesetzt 21.Jhd
+        strcpy(e->epoch, "20");
+        for (i = 0; i < 5; i++) {
+            e->epoch[2+2*i] = 3+3*i < len && l[3+3*i] != ' ' ? l[3+3*i] : '0';
+            e->epoch[3+2*i] = 4+3*i < len ? l[4+3*i] : '0';
         }
-        str[12] = buf[17];
-        str[13] = buf[18];
-        str[14] = '\0';
-
-        strncpy(ephem.epoch  , "20", 2);  // vorausgesetzt 21.Jhd; Datum steht auch im Header
-        strncpy(ephem.epoch+2, str, 15);
-        ephem.epoch[16] = '\0';
+        e->epoch[12] = 18 < len && l[18] != ' ' ? l[18] : '0';
+        e->epoch[13] = 19 < len ? l[19] : '0';
+        e->epoch[14] = '\0';
+        char sec[6] = { 0 };
+        for (i = 0; i < 5 && 17+i < len; i++) sec[i] = l[17+i];
+        e->toc = rnxtow(e->epoch, atof(sec));
+        e->af0 = rnxfield(l, len, 22);
+        e->af1 = rnxfield(l, len, 41);
+        e->af2 = rnxfield(l, len, 60);
+        rnx->state = 1;
+        return;
+    }
+    for (i = 0; i < 4; i++) d[i] = rnxfield(l, len, 3+19*i);
+    switch (rnx->state) {
+    case 1: e->crs = d[1];  e->delta_n = d[2];  e->M0 = d[3];  break;        // iode
+    case 2: e->cuc = d[0];  e->e = d[1];  e->cus = d[2];  e->sqrta = d[3];  break;
+    case 3: e->toe = d[0];  e->cic = d[1];  e->Omega0 = d[2];  e->cis = d[3];  break;
+    case 4: e->i0 = d[0];  e->crc = d[1];  e->w = d[2];  e->OmegaDot = d[3];  break;
+    case 5: e->idot = d[0];  e->gpsweek = (int)d[2];  break;               // codeL2, L2P
+    case 6: e->health = (uint8_t)(d[1]+0.1);  e->tgd = d[2];  break;       // sva, iodc
+    }
+    if (rnx->state < 7) { rnx->state++; return; }
+
+    // line 7 (ttom, fit) completes the record
+    rnx->state = 0;
+    e->week = 1; // ephem.gpsweek
+    if (e->prn > 0 && e->prn < 33) {
+        rnx->eph[e->prn] = *e;
+        rnx->count++;
+        if (rnx->out && rnx->nout >= 0) {
+            EPHBIN_t r;
+            ephbin_pack(e, &r);
+            if (rnx->out->write((const uint8_t *)&r, sizeof(r)) == sizeof(r)) rnx->nout++;
+            else rnx->nout = -1;
+        }
+    } else {
+        Serial.printf("bad prn: %d\n", e->prn);
+    }
+}
 
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.af0 = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.af1 = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.af2 = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+void RNX_feed(RNX_t *rnx, const char *data, int len) {
+    for (int i = 0; i < len; i++) {
+        char c = data[i];
+        if (c == '\n') {
+            if (rnx->len > 0 && rnx->line[rnx->len-1] == '\r') rnx->len--;
+            rnx->line[rnx->len] = 0;
+            rnxline(rnx);
+            rnx->len = 0;
+        }
+        else if (rnx->len < RNX_MAXLINE) rnx->line[rnx->len++] = c;
+    }
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.iode = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.crs = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.delta_n = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.M0 = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+EPHEM_t *RNX_result(RNX_t *rnx) {
+    int n = 1;
+    if (rnx->len > 0) RNX_feed(rnx, "\n", 1);   // last line without newline
+    // eph[prn] -> list terminated by prn 0, a PRN without record would end it early
+    for (int prn = 1; prn < 33; prn++) {
+        if (rnx->eph[prn].prn != prn) continue;
+        if (n != prn) rnx->eph[n] = rnx->eph[prn];
+        n++;
+    }
+    rnx->eph[n].prn = 0;
+    return n > 1 ? rnx->eph : NULL;
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.cuc = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.e = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.cus = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.sqrta = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+EPHEM_t *read_RNXpephs(const char *file, const char *binfile) {
+    RNX_t rnx;
+    char buf[256];
+    int len;
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.toe = dbl;
-                                                                                                                                    ephem.toc = ephem.toe;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.cic = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.Omega0 = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.cis = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+    File fp = SPIFFS.open(file, "r");
+    if (!fp) { Serial.printf("Error opening %s\n", file); return NULL; }
+    if (RNX_init(&rnx) < 0) { fp.close(); return NULL; }
+    if (binfile) EPHbin_begin(&rnx, binfile);
+    while ((len = fp.read((uint8_t *)buf, sizeof(buf))) > 0) RNX_feed(&rnx, buf, len);
+    EPHEM_t *eph = RNX_result(&rnx);
+    EPHbin_end(&rnx, fp.size(), eph != NULL);
+    fp.close();
+    return eph;
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.i0 = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.crc = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.w = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.OmegaDot = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+// Attaches <file> to the parser, written to <file>.new and renamed by EPHbin_end,
+// so a failed download or conversion keeps the previous file
+int EPHbin_begin(RNX_t *rnx, const char *file) {
+    snprintf(rnx->outfile, sizeof(rnx->outfile), "%s.new", file);
+    File *fp = new File(SPIFFS.open(rnx->outfile, "w"));
+    EPHBIN_HDR_t hdr = { EPHBIN_MAGIC, sizeof(EPHBIN_t), 0 };
+    if (!*fp || fp->write((const uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)) {
+        Serial.printf("Error opening %s for writing\n", rnx->outfile);
+        fp->close();
+        delete fp;
+        SPIFFS.remove(rnx->outfile);
+        return -1;
+    }
+    rnx->out = fp;
+    rnx->nout = 0;
+    return 0;
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.idot = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.codeL2 = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.gpsweek = (int)dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.iodc = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+// Completes the file if ok, discards it otherwise. Returns number of records or -1
+int EPHbin_end(RNX_t *rnx, uint32_t srclen, bool ok) {
+    File *fp = rnx->out;
+    if (fp == NULL) return -1;
+    rnx->out = NULL;
+
+    EPHBIN_TRL_t trl = { srclen, (uint32_t)rnx->nout };
+    ok = ok && rnx->nout > 0 && fp->write((const uint8_t *)&trl, sizeof(trl)) == sizeof(trl);
+    fp->close();
+    delete fp;
+
+    char file[32];
+    strcpy(file, rnx->outfile);
+    file[strlen(file)-4] = 0;    // strip ".new"
+    if (!ok || (SPIFFS.exists(file) && !SPIFFS.remove(file)) || !SPIFFS.rename(rnx->outfile, file)) {
+        SPIFFS.remove(rnx->outfile);
+        return -1;
+    }
+    Serial.printf("Wrote %d ephemerides to %s\n", rnx->nout, file);
+    return rnx->nout;
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.sva = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.health = (uint8_t)(dbl+0.1);
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); ephem.tgd = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.iodc = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }
+// selection key of a record, smaller is better
+static double ephbin_dist(const EPHBIN_t *r, double t) {
+    if (t < 0) return -(r->gpsweek*(double)WEEKSEC + r->toe);   // most recent
+    double td = fmod(fabs(t - r->toe), WEEKSEC);
+    return td > WEEKSEC/2 ? WEEKSEC - td : td;
+}
 
-        l = fread(buf,  3, 1, fp);    if (l != 1) break;  buf[ 3] = 0;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.ttom = dbl;
-	String l = fp.readStringUntil('\n');
-     /* // die letzten beiden Felder (spare) sind manchmal leer (statt 0.00); manchmal fehlt sogar das drittletzte Feld
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.fit = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.spare1 = dbl;
-        l = fread(buf, 19, 1, fp);    if (l != 1) break;  if (buf[15] == 'D') buf[15] = 'E'; buf[19] = 0; sscanf(buf, "%lf", &dbl); //ephem.spare2 = dbl;
-        while ((c=fgetc(fp)) != '\n') { if (c == EOF) break; }  */
+// Loads the EPH_PERPRN records per PRN with toe closest to GPS time of week t (t < 0: most recent).
+// Returns NULL if the file does not exist, is invalid or does not match srclen (if nonzero);
+// the list returned before stays valid in that case.
+EPHEM_t *read_EPHbin(const char *file, uint32_t srclen, double t) {
+    File fp = SPIFFS.open(file, "r");
+    if (!fp) return NULL;
+
+    EPHBIN_HDR_t hdr;
+    EPHBIN_TRL_t trl;
+    size_t size = fp.size();
+    bool ok = fp.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == EPHBIN_MAGIC &&
+        hdr.reclen == sizeof(EPHBIN_t) && size >= sizeof(hdr) + sizeof(trl) &&
+        fp.seek(size - sizeof(trl)) && fp.read((uint8_t *)&trl, sizeof(trl)) == sizeof(trl) &&
+        size == sizeof(hdr) + trl.count * sizeof(EPHBIN_t) + sizeof(trl) &&
+        (srclen == 0 || trl.srclen == srclen) && fp.seek(sizeof(hdr));
+    if (!ok) {
+        Serial.printf("%s is outdated or invalid\n", file);
+        fp.close();
+        return NULL;
+    }
 
-        ephem.week = 1; // ephem.gpsweek
-	//Serial.printf("Reading ephem for prn %d\n", ui);
-	if(ui<33) {
-#if 0
-		// no need to do it the difficult way, most recent data is at end of file :-)
-		double tdiff;
-		if(te[ui].prn!=ui) {
-			tdiff = WEEKSEC;
-		} else {
-			tdiff = now - te[ui].toe;
-			if(tdiff>WEEKSEC/2) tdiff -= WEEKSEC;
-			if(tdiff<-WEEKSEC/2) tdiff += WEEKSEC;
-		}
-		double td = now - ephem.toe;
-		if(td>WEEKSEC/2) td -= WEEKSEC;
-		if(td<-WEEKSEC/2) td += WEEKSEC;
-#endif		
-		te[ui] = ephem;
-	} else {
-		Serial.printf("bad prn: %d\n", ui);
-	}
-        //if (pbuf == NULL) break;
-	if(!fp.available()) break;
+    // select into scratch buffers, te is only overwritten once the whole file is valid
+    EPHBIN_t *sel = (EPHBIN_t *)malloc( 32*EPH_PERPRN * sizeof(EPHBIN_t) );
+    double *dsel = (double *)malloc( 32*EPH_PERPRN * sizeof(double) );
+    int i, k, n = 1;
+    ok = sel && dsel;
+    for (i = 0; ok && i < 32*EPH_PERPRN; i++) dsel[i] = HUGE_VAL;   // empty
+    for (i = 0; ok && i < trl.count; i++) {
+        EPHBIN_t r;
+        if (fp.read((uint8_t *)&r, sizeof(r)) != sizeof(r) || r.prn == 0 || r.prn > 32) { ok = false; break; }
+        EPHBIN_t *s = sel + (r.prn-1)*EPH_PERPRN;
+        double *ds = dsel + (r.prn-1)*EPH_PERPRN;
+        double dr = ephbin_dist(&r, t);
+        int w = 0;
+        for (k = 0; k < EPH_PERPRN; k++) {
+            // repeated broadcast of the same ephemeris: keep the later one
+            if (ds[k] < HUGE_VAL && s[k].toe == r.toe && s[k].gpsweek == r.gpsweek) { w = k; ds[w] = HUGE_VAL; break; }
+            if (ds[k] > ds[w]) w = k;
+        }
+        if (dr <= ds[w]) { s[w] = r;  ds[w] = dr; }
     }
-    te[33].prn=0;
-    return te;
+    fp.close();
+    if (ok && te_alloc() == NULL) ok = false;
+    if (ok) {
+        for (i = 0; i < 32*EPH_PERPRN; i++) if (dsel[i] < HUGE_VAL) ephbin_unpack(sel+i, te + n++);
+        te[n].prn = 0;
+        Serial.printf("Read %d of %d ephemerides from %s\n", n-1, trl.count, file);
+    } else {
+        Serial.printf("%s is invalid\n", file);
+    }
+    free(dsel);
+    free(sel);
+    return ok ? te : NULL;
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -1768,6 +1916,94 @@ int NAV_LinP(int N, SAT_t satv[], double pos_ecef[3], double dt,
     return 0;
 }
 
+/* Iterative weighted least squares position fix over all N satellites.
+   Pseudoranges are weighted by sin^2 of satellite elevation.
+   input:  pos_ecef: start position (e.g. from NAV_bancroft1), *cc: start clock term
+   output: pos_ecef, *cc (pseudorange + clock_corr = range - cc),
+           res[i]: post-fit residuals [m], w[i]: weights,
+           h[i]: diagonal of hat matrix (influence of observation i on its own fit)
+   returns number of iterations, -1 if geometry is singular, -2 if not converged */
+#define WLS_MAXITER   8
+#define WLS_CONV      0.01    // [m]
+#define WLS_MINWEIGHT 0.05
+
+int NAV_WLS(int N, SAT_t satv[], double pos_ecef[3], double *cc,
+                   double res[], double w[], double h[]) {
+
+    int i, j, k, it;
+    double G[N][4], GtWG[4][4], Q[4][4], GtWa[4], x[4];
+    double up[3], rpos, range, sinel, dx;
+    double X, Y, Z, norm;
+
+    if (N < 4 || N > 12) return -1;
+
+    for (it = 0; it < WLS_MAXITER; it++) {
+        rpos = sqrt(pos_ecef[0]*pos_ecef[0] + pos_ecef[1]*pos_ecef[1] + pos_ecef[2]*pos_ecef[2]);
+        for (j = 0; j < 3; j++) up[j] = rpos > 1e6 ? pos_ecef[j]/rpos : 0;
+
+        for (i = 0; i < N; i++) {
+            range = dist( pos_ecef[0], pos_ecef[1], pos_ecef[2], satv[i].X, satv[i].Y, satv[i].Z );
+            range /= LIGHTSPEED;
+            if (range < 0.06  ||  range > 0.1) range = RANGE_ESTIMATE;
+            rotZ(satv[i].X, satv[i].Y, satv[i].Z, EARTH_ROTATION_RATE*range, &X, &Y, &Z);
+            X -= pos_ecef[0];
+            Y -= pos_ecef[1];
+            Z -= pos_ecef[2];
+            norm = sqrt(X*X+Y*Y+Z*Z);
+            G[i][0] = X/norm;
+            G[i][1] = Y/norm;
+            G[i][2] = Z/norm;
+            G[i][3] = 1;
+
+            // no elevation before position is near earth surface
+            sinel = rpos > 1e6 ? G[i][0]*up[0] + G[i][1]*up[1] + G[i][2]*up[2] : 1;
+            w[i] = sinel*sinel;
+            if (sinel < 0  ||  w[i] < WLS_MINWEIGHT) w[i] = WLS_MINWEIGHT;
+
+            res[i] = norm - *cc - (satv[i].pseudorange + satv[i].clock_corr);
+        }
+
+        for (i = 0; i < 4; i++) {
+            for (j = 0; j < 4; j++) {
+                GtWG[i][j] = 0.0;
+                for (k = 0; k < N; k++) {
+                    GtWG[i][j] += G[k][i]*w[k]*G[k][j];
+                }
+            }
+            GtWa[i] = 0.0;
+            for (k = 0; k < N; k++) {
+                GtWa[i] += G[k][i]*w[k]*res[k];
+            }
+        }
+        if (matrix_invert(GtWG, Q) != 0) return -1;
+
+        for (i = 0; i < 4; i++) {
+            x[i] = 0.0;
+            for (k = 0; k < 4; k++) x[i] += Q[i][k]*GtWa[k];
+        }
+        for (j = 0; j < 3; j++) pos_ecef[j] += x[j];
+        *cc += x[3];
+
+        // post-fit residuals
+        for (i = 0; i < N; i++) {
+            for (k = 0; k < 4; k++) res[i] -= G[i][k]*x[k];
+        }
+
+        dx = sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+        if (dx < WLS_CONV) break;
+    }
+
+    for (i = 0; i < N; i++) {
+        h[i] = 0.0;
+        for (j = 0; j < 4; j++) {
+            for (k = 0; k < 4; k++) h[i] += G[i][j]*Q[j][k]*G[i][k];
+        }
+        h[i] *= w[i];
+    }
+
+    return it < WLS_MAXITER ? it+1 : -2;
+}
+
 int NAV_LinV(int N, SAT_t satv[], double pos_ecef[3],
                     double vel_ecef[3], double dt,
                     double dvel_ecef[3], double *cc) {
@@ -143,6 +143,39 @@ int NAV_LinV(int N, SAT_t satv[], double pos_ecef[3],
 
 int NAV_bancroft1(int N, SAT_t sats[], double pos_ecef[3], double *cc);
 
-EPHEM_t *read_RNXpephs(const char *file);
+int NAV_WLS(int N, SAT_t satv[], double pos_ecef[3], double *cc,
+                   double res[], double w[], double h[]);
+
+// Parses a RINEX file, all records are also written to binfile if given
+EPHEM_t *read_RNXpephs(const char *file, const char *binfile = NULL);
+
+// Records held in RAM: EPH_PERPRN per PRN, list te[1..n] terminated by prn 0
+#define EPH_PERPRN 2
+#define EPH_MAXREC (32*EPH_PERPRN+2)
+
+namespace fs { class File; }
+
+// Incremental RINEX navigation parser (RNX_init, any number of RNX_feed, RNX_result)
+#define RNX_MAXLINE 82
+typedef struct {
+    char line[RNX_MAXLINE+1];
+    int len;
+    int state;          // -1: header, 0..7: line of record
+    int count;          // records parsed
+    EPHEM_t ephem;      // record in progress
+    EPHEM_t *eph;       // eph[prn], most recent record per PRN
+    fs::File *out;      // binary file receiving all records (EPHbin_begin)
+    int nout;           // records written, -1 on write error
+    char outfile[32];
+} RNX_t;
+
+int RNX_init(RNX_t *rnx);
+void RNX_feed(RNX_t *rnx, const char *data, int len);
+EPHEM_t *RNX_result(RNX_t *rnx);
+
+// Binary ephemeris file (converted from RINEX while parsing)
+int EPHbin_begin(RNX_t *rnx, const char *file);
+int EPHbin_end(RNX_t *rnx, uint32_t srclen, bool ok);
+EPHEM_t *read_EPHbin(const char *file, uint32_t srclen, double t);
 
 
@@ -56,6 +56,7 @@
 
 
 gpx_t gpx;
+uint32_t gps_us;
 
 int option_verbose = 0,  // ausfuehrliche Anzeige
     option_raw = 1,      // rohe Frames
@@ -70,9 +71,11 @@ int option_verbose = 0,  // ausfuehrliche Anzeige
     option_vel = 0,      // velocity
     option_aux = 0,      // Aux/Ozon
     option_der = 0,      // linErr
+    option_wls = 1,      // weighted least squares fix (fallback: best 4 sat combination)
     rawin = 0;
 double dop_limit = 9.9;
 double d_err = 10000;
+double raim_limit = 30.0;   // rms of weighted residuals [m] above which a satellite is excluded
 
 int rollover = 0,
     err_gps = 0;
@@ -105,7 +108,10 @@ char buf[HEADLEN+1] = "x";
 int bufpos = -1;
 
 #define FRAME_LEN 240
-uint8_t frame[FRAME_LEN] = { 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x10};
+// frame being decoded: points to the caller's buffer (see print_frame),
+// framebuf is only used for short frames that need zero padding
+uint8_t framebuf[FRAME_LEN] = { 0x2A, 0x2A, 0x2A, 0x2A, 0x2A, 0x10};
+uint8_t *frame = framebuf;
 /* --- RS92-SGP ------------------- */
 
 
@@ -620,6 +626,9 @@ int get_Cal() {
 //we only use ephs  EPHEM_t alm[33];
 //EPHEM_t eph[33][24];
 EPHEM_t *ephs = NULL;
+static char ephbin[32];         // binary ephemeris file ephs were selected from
+static double ephsel_t = -1;    // GPS time of week of that selection, <0: most recent records
+#define EPH_RESELECT 3600       // reselect once frame time is this far from ephsel_t [s]
 
 SAT_t sat[33],
       sat1s[33];
@@ -800,6 +809,81 @@ int calc_satpos_rnx(EPHEM_t eph[][24], double t, SAT_t *satp) {
     return 0;
 }
 
+/*
+ * Satellite position cache: orbits (position, velocity, clock correction and
+ * drift) are evaluated at knots every SATCACHE_STEP seconds of GPS time, the
+ * values in between are interpolated with cubic Hermite polynomials (error of
+ * a few mm for 60s). With 1 frame per second, the Kepler orbit of a satellite
+ * is computed once per minute instead of once (or twice) per frame.
+ * The cache of a satellite is invalidated if a different ephemeris is
+ * selected for it or if ephemerides are reloaded (eph_generation).
+ */
+#define SATCACHE_STEP 60.0
+
+typedef struct {
+    double t;           // GPS time of week of knot, <0: invalid
+    double x[4];        // X, Y, Z, clock correction
+    double v[4];        // vX, vY, vZ, clock drift
+} SATKNOT_t;
+
+typedef struct {
+    EPHEM_t *eph;       // ephemeris the knots are computed from
+    int week;
+    uint32_t gen;
+    SATKNOT_t k[2];     // knots at start and end of current interval
+} SATCACHE_t;
+
+static SATCACHE_t satcache[33];
+uint32_t eph_generation = 1;
+int option_satcache = 1;
+
+static void satknot(int week, double t, EPHEM_t *eph, SATKNOT_t *k) {
+    k->t = t;
+    GPS_SatellitePositionVelocity_Ephem(
+        week, t, *eph,
+        &k->x[3], &k->v[3], &k->x[0], &k->x[1], &k->x[2], &k->v[0], &k->v[1], &k->v[2]
+    );
+}
+
+static void calc_satpos_cached(int j, int week, double t, EPHEM_t *eph, SAT_t *satp) {
+    SATCACHE_t *c = satcache+j;
+    double t0 = floor(t/SATCACHE_STEP)*SATCACHE_STEP;
+    double h = SATCACHE_STEP;
+    double u, h00, h10, h01, h11, d00, d10, d01, d11, x[4], v[4];
+    int i;
+
+    if (c->eph != eph  ||  c->week != week  ||  c->gen != eph_generation) {
+        c->eph = eph;
+        c->week = week;
+        c->gen = eph_generation;
+        c->k[0].t = c->k[1].t = -1;
+    }
+    if (c->k[0].t != t0) {
+        if (c->k[1].t == t0) c->k[0] = c->k[1];  // next interval: reuse end knot
+        else satknot(week, t0, eph, &c->k[0]);
+        satknot(week, t0+h, eph, &c->k[1]);
+    }
+
+    u = (t-t0)/h;
+    h00 = (1+2*u)*(1-u)*(1-u);  d00 = 6*u*u-6*u;
+    h10 = u*(1-u)*(1-u);        d10 = 3*u*u-4*u+1;
+    h01 = u*u*(3-2*u);          d01 = -6*u*u+6*u;
+    h11 = u*u*(u-1);            d11 = 3*u*u-2*u;
+    for (i = 0; i < 4; i++) {
+        x[i] = h00*c->k[0].x[i] + h10*h*c->k[0].v[i] + h01*c->k[1].x[i] + h11*h*c->k[1].v[i];
+        v[i] = (d00*c->k[0].x[i] + d01*c->k[1].x[i])/h + d10*c->k[0].v[i] + d11*c->k[1].v[i];
+    }
+
+    satp[j].X = x[0];
+    satp[j].Y = x[1];
+    satp[j].Z = x[2];
+    satp[j].clock_corr = x[3];
+    satp[j].vX = v[0];
+    satp[j].vY = v[1];
+    satp[j].vZ = v[2];
+    satp[j].clock_drift = v[3];
+}
+
 int calc_satpos_rnx2(EPHEM_t *eph, double t, SAT_t *satp) {
     double X, Y, Z, vX, vY, vZ;
     int j;
@@ -835,7 +919,11 @@ int calc_satpos_rnx2(EPHEM_t *eph, double t, SAT_t *satp) {
             count += 1;
         }
 
-        if ( satfound )
+        if ( satfound  &&  option_satcache ) {
+            calc_satpos_cached(j, week, t, eph+count0, satp);
+            satp[j].ephtime = eph[count0].toe;
+        }
+        else if ( satfound )
         {
             if (option_vel >= 2) {
                 GPS_SatellitePositionVelocity_Ephem(
@@ -924,6 +1012,12 @@ int get_pseudorange() {
 
     // GPS Sat Pos (& Vel)
     //if (almanac) calc_satpos_alm(  alm, gpstime/1000.0, sat);
+    // keep the records bracketing the frame time in RAM
+    if (ephem && ephbin[0] && (ephsel_t < 0 ||
+        fabs(remainder(gpstime/1000.0 - ephsel_t, WEEKSEC)) > EPH_RESELECT)) {
+        ephsel_t = gpstime/1000.0;
+        if (read_EPHbin(ephbin, 0, ephsel_t)) eph_generation++;
+    }
     if (ephem)   calc_satpos_rnx2(ephs, gpstime/1000.0, sat);
 
     // GPS Sat Pos t -= 1s
@@ -1111,6 +1205,82 @@ int naiv_2Dfix(int N, SAT_t sats[], double alt) {
 }
 
 
+// weighted rms of residuals of a WLS fix, -1 if no fix
+static double wls_sigma(int n, SAT_t sats[], double pos_ecef[3], double *cc) {
+    double res[12], w[12], h[12], sse = 0;
+    int j;
+    if (NAV_WLS(n, sats, pos_ecef, cc, res, w, h) < 0) return -1;
+    for (j = 0; j < n; j++) sse += w[j]*res[j]*res[j];
+    return n > 4 ? sqrt(sse/(n-4)) : 0;
+}
+
+/* Position (velocity with option_vel >= 2) from all N satellites (weighted
+   least squares), with RAIM: while the residuals are inconsistent, the satellite
+   whose exclusion gives the most consistent fix is removed (as long as 5 remain)
+   returns number of satellites used, 0 if no consistent fix with GDOP below
+   dop_limit was found */
+static int get_GPSkoord_wls(int N) {
+    SAT_t Sat_B[12], Sat_C[12];
+    int prn_B[12];
+    double pos_ecef[3], pos0_ecef[3], vel_ecef[3], dvel_ecef[3];
+    double rx_cl_bias, cc0, sigma, sigma0, smin;
+    double lat, lon, alt, vH, vD, vU, gdop;
+    int j, k, n, ex, jmin;
+
+    for (j = 0; j < N; j++) { Sat_B[j] = sat[prn[j]]; prn_B[j] = prn[j]; }
+    n = N;
+
+    if (NAV_bancroft1(n, Sat_B, pos_ecef, &rx_cl_bias) != 0) return 0;
+    rx_cl_bias = 0;
+    sigma = wls_sigma(n, Sat_B, pos_ecef, &rx_cl_bias);
+    while (sigma >= raim_limit) {
+        if (n <= 5) return 0;  // inconsistent, but outlier can not be identified
+        jmin = -1; smin = sigma;
+        for (ex = 0; ex < n; ex++) {
+            for (j = 0, k = 0; j < n; j++) if (j != ex) Sat_C[k++] = Sat_B[j];
+            for (j = 0; j < 3; j++) pos0_ecef[j] = pos_ecef[j];
+            cc0 = rx_cl_bias;
+            sigma0 = wls_sigma(n-1, Sat_C, pos0_ecef, &cc0);
+            if (sigma0 >= 0  &&  sigma0 < smin) { smin = sigma0; jmin = ex; }
+        }
+        if (jmin < 0) return 0;
+        if (prn_B[jmin] == prn32next) prn32toggle ^= 0x1;
+        for (j = jmin; j < n-1; j++) { Sat_B[j] = Sat_B[j+1]; prn_B[j] = prn_B[j+1]; }
+        n--;
+        sigma = wls_sigma(n, Sat_B, pos_ecef, &rx_cl_bias);
+    }
+    if (sigma < 0) return 0;
+
+    ecef2elli(pos_ecef[0], pos_ecef[1], pos_ecef[2], &lat, &lon, &alt);
+    if (alt < -1000 || alt > 60000) return 0;
+    gdop = -1;
+    if (calc_DOPn(n, Sat_B, pos_ecef, DOP) == 0) {
+        gdop = sqrt(DOP[0]+DOP[1]+DOP[2]+DOP[3]);
+    }
+    if (gdop < 0  ||  gdop >= dop_limit) return 0;
+
+    gpx.lat = lat;
+    gpx.lon = lon;
+    gpx.alt = alt;
+    gpx.dop = gdop;
+    gpx.diter = sigma;
+    for (j = 0; j < 4; j++) gpx.sats[j] = prn_B[j];
+
+    // satellite velocities are only calculated with option_vel >= 2
+    if (option_vel >= 2) {
+        vel_ecef[0] = vel_ecef[1] = vel_ecef[2] = 0;
+        NAV_LinV(n, Sat_B, pos_ecef, vel_ecef, 0.0, dvel_ecef, &rx_cl_bias);
+        for (j=0; j<3; j++) vel_ecef[j] += dvel_ecef[j];
+        NAV_LinV(n, Sat_B, pos_ecef, vel_ecef, rx_cl_bias, dvel_ecef, &rx_cl_bias);
+        for (j=0; j<3; j++) vel_ecef[j] += dvel_ecef[j];
+        get_GPSvel(lat, lon, vel_ecef, &vH, &vD, &vU);
+        gpx.vH = vH;
+        gpx.vD = vD;
+        gpx.vU = vU;
+    }
+    return n;
+}
+
 int get_GPSkoord(int N) {
     double lat, lon, alt, rx_cl_bias;
     double vH, vD, vU;
@@ -1138,6 +1308,12 @@ int get_GPSkoord(int N) {
 
     gpx.lat = gpx.lon = gpx.alt = 0;
 
+    if (option_wls  &&  option_vergps == 0) {
+        num = get_GPSkoord_wls(N);
+        if (num > 0) return num;
+        gpx.lat = gpx.lon = gpx.alt = 0;
+    }
+
     if (option_vergps != 2) {
     for (i0=0;i0<N;i0++) { for (i1=i0+1;i1<N;i1++) { for (i2=i1+1;i2<N;i2++) { for (i3=i2+1;i3<N;i3++) {
 
@@ -1361,11 +1537,13 @@ int print_position() {  // GPS-Hoehe ueber Ellipsoid
 #endif
 
     if (!err2 && (almanac || ephem)) {
+        uint32_t t0 = micros();
         k = get_pseudorange();
-	Serial.printf("k=%d\n", k);
         if (k >= 4) {
             n = get_GPSkoord(k);
         }
+        gps_us = micros() - t0;
+	Serial.printf("k=%d\n", k);
 	if (k == 3) {
 	    SAT_t Sat_A[4];
 	    for (j = 0; j < 3; j++) { Sat_A[j] = sat[prn[j]]; }
@@ -1446,11 +1624,16 @@ void print_frame(uint8_t *data, int len) {
     int i;
     uint8_t byte;
 
-    for (i = 0; i<len; i++) {
-	frame[i] = data[i];
-    }
-    for (i = len; i < FRAME_LEN; i++) {
-        frame[i] = 0;
+    if (len >= FRAME_LEN) {
+        frame = data;
+    } else {
+        frame = framebuf;
+        for (i = 0; i<len; i++) {
+            frame[i] = data[i];
+        }
+        for (i = len; i < FRAME_LEN; i++) {
+            frame[i] = 0;
+        }
     }
 
     if (option_raw) {
@@ -1466,7 +1649,21 @@ void print_frame(uint8_t *data, int len) {
 }
 
 void get_eph(const char *file) {
-        ephs = read_RNXpephs(file);
+        // prefer binary copy <file>.bin, (re)create it if missing or outdated
+        char binfile[32];
+        snprintf(binfile, 32, "%s.bin", file);
+        uint32_t srclen = 0;
+        if (SPIFFS.exists(file)) {
+            File fp = SPIFFS.open(file, "r");
+            srclen = fp.size();
+            fp.close();
+        }
+        ephs = read_EPHbin(binfile, srclen, -1);
+        if (!ephs) ephs = read_RNXpephs(file, binfile);
+        // selected again for the time of the first frame
+        strcpy(ephbin, binfile);
+        ephsel_t = -1;
+        eph_generation++;
         if (ephs) {
             ephem = 1;
             almanac = 0;
@@ -16,6 +16,11 @@ typedef struct {
 } gpx_t;
 
 extern gpx_t gpx;
+// 1: weighted least squares fix with RAIM, 0: best 4 satellite combination only
+extern int option_wls;
+// time of the position solution of the last frame (us, without output), for Bench.cpp
+extern uint32_t gps_us;
 
+// decode frame (data is used in place, must not change until print_frame returns)
 void print_frame(uint8_t *data, int len); 
 void get_eph(const char *file);
@@ -9,6 +9,8 @@
 #ifndef inttypes_h
         #include <inttypes.h>
 #endif
+#include <string.h>
+#include "rsc.h"
 
 #define N 255
 #define R 24
@@ -26,7 +28,29 @@ void initrsc()
 }
 
 
-int decodersc(char *data, uint32_t *eras_pos, uint32_t no_eras)
+long decodersc(char *data, uint32_t *eras_pos, uint32_t no_eras)
 {
  return decode_rs_char(rs, (unsigned char *)data, (int *)eras_pos, no_eras);
 }
+
+long decodersc_frame(const RSSeg *seg, int nseg, uint32_t *eras_pos, uint32_t no_eras)
+{
+ unsigned char s[R];
+ unsigned char b[N];
+ int i, j, k, n;
+ if(!syndromes_rs_char(rs, seg, nseg, s)) return 0;
+ /* errors: copy codeword, with leading zeros, for the full decoder */
+ n = 0;
+ for(k=0; k<nseg; k++) n += seg[k].n;
+ memset(b, 0, N-n);
+ for(k=0, j=N-n; k<nseg; k++) {
+  for(i=0; i<seg[k].n; i++) b[j++] = seg[k].p[i*seg[k].stride];
+ }
+ long res = decode_rs_syn(rs, b, s, (int *)eras_pos, no_eras);
+ if(res>0) {
+  for(k=0, j=N-n; k<nseg; k++) {
+   for(i=0; i<seg[k].n; i++) seg[k].p[i*seg[k].stride] = b[j++];
+  }
+ }
+ return res;
+}
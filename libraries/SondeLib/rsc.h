@@ -8,10 +8,34 @@
 #ifndef rsc_H_
 #define rsc_H_
 
+#include <stdint.h>
+
+
+/* Codeword stored in a frame, as segments of symbols in order of decreasing
+ * degree (leading zero symbols of a shortened code omitted): n symbols
+ * starting at p, with address step stride (may be negative)
+ */
+typedef struct st_rsseg {
+	uint8_t *p;
+	int n;
+	int stride;
+} RSSeg;
 
 long decodersc(char [], uint32_t [], uint32_t);
 
+/* Correct a codeword in place within the frame. Syndromes are computed
+ * directly on the frame, the full decoder only runs if they are non-zero.
+ * Returns number of corrected symbols, or -1 if uncorrectable
+ */
+long decodersc_frame(const RSSeg *seg, int nseg, uint32_t *eras_pos, uint32_t no_eras);
+
 void initrsc(void);
 
+/* 1: table driven syndromes and index sums (default), 0: reference implementation */
+extern int rsc_use_packed;
+
+int syndromes_rs_char(void *rs, const RSSeg *seg, int nseg, unsigned char *s);
+int decode_rs_syn(void *rs, unsigned char *data, unsigned char *s, int *eras_pos, int no_eras);
+
 
 #endif /* rsc_H_ */
@@ -36,12 +36,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include "rsc.h"
+
+#define MAXROOTS 32		/* maximum number of roots supported by the decoder */
 
 struct rs {
 	unsigned int magic;		/* struct magic */
 	int mm;				/* Bits per symbol */
 	int nn;				/* Symbols per block (= (1<<mm)-1) */
 	unsigned char *alpha_to;	/* log lookup table */
+	unsigned char *alpha_ext;	/* alpha_to for 0..3*nn-1, sum of indices without modnn */
+	unsigned char *synmul;		/* nroots tables: multiply by alpha**((fcr+i)*prim) */
 	unsigned char *index_of;	/* Antilog lookup table */
 	unsigned char *genpoly;		/* Generator polynomial */
 	int nroots;			/*
@@ -64,6 +70,13 @@ static inline int modnn(struct rs *rs,int x)
 }
 
 #define MODNN(x) modnn(rs, x)
+
+/* 0: reference decoder as in the original code (MODNN per sum of indices,
+ * one syndrome at a time), for comparison by the benchmark */
+int rsc_use_packed = 1;
+
+/* alpha**x for a sum x of up to three indices */
+#define ALPHA_SUM(x) (rsc_use_packed ? rs->alpha_ext[x] : rs->alpha_to[MODNN(x)])
 #define	MIN(a,b)	((a) < (b) ? (a) : (b))
 #define MAGIC		0xABCD6722
 
@@ -78,6 +91,10 @@ void free_rs_char(void *arg)
 
 	if (rs->alpha_to != NULL)
 		free(rs->alpha_to);
+	if (rs->alpha_ext != NULL)
+		free(rs->alpha_ext);
+	if (rs->synmul != NULL)
+		free(rs->synmul);
 	if (rs->index_of != NULL)
 		free(rs->index_of);
 	if (rs->genpoly != NULL)
@@ -107,7 +124,7 @@ void *init_rs_char(int symsize, int gfpoly, int fcr, int prim,
 		return NULL;
 	if (prim <= 0 || prim >= (1<<symsize))
 		return NULL;
-	if (nroots < 0 || nroots >= (1<<symsize))
+	if (nroots < 0 || nroots >= (1<<symsize) || nroots > MAXROOTS)
 		return NULL;
 	if (pad < 0 || pad >= ((1<<symsize) -1 - nroots))
 		return NULL;
@@ -191,13 +208,124 @@ void *init_rs_char(int symsize, int gfpoly, int fcr, int prim,
 	for (i = 0; i <= nroots; i++)
 		rs->genpoly[i] = rs->index_of[rs->genpoly[i]];
 
+	/* Tables for the decoder */
+	rs->alpha_ext = (unsigned char *)malloc(3*rs->nn);
+	rs->synmul = (unsigned char *)malloc(nroots*(rs->nn+1));
+	if (rs->alpha_ext == NULL || rs->synmul == NULL) {
+		free_rs_char(rs);
+		return NULL;
+	}
+	for (i = 0; i < 3*rs->nn; i++)
+		rs->alpha_ext[i] = rs->alpha_to[i % rs->nn];
+	for (i = 0; i < nroots; i++) {
+		unsigned char *m = rs->synmul + i*(rs->nn+1);
+		m[0] = 0;
+		for (j = 1; j <= rs->nn; j++)
+			m[j] = rs->alpha_to[modnn(rs, rs->index_of[j] + (fcr+i)*prim)];
+	}
+
 	return rs;
 }
 
+/* Reference: evaluate data(x) at each root separately (original implementation) */
+static int syndromes_ref(struct rs *rs, const RSSeg *seg, int nseg, unsigned char *s)
+{
+	int i, j, k, syn_error = 0;
+
+	for (i = 0; i < rs->nroots; i++)
+		s[i] = 0;
+	for (k = 0; k < nseg; k++) {
+		const unsigned char *p = seg[k].p;
+		for (j = seg[k].n; j > 0; j--, p += seg[k].stride) {
+			for (i = 0; i < rs->nroots; i++) {
+				if (s[i] == 0)
+					s[i] = *p;
+				else
+					s[i] = *p ^ rs->alpha_to[MODNN(rs->index_of[s[i]] + (rs->fcr+i)*rs->prim)];
+			}
+		}
+	}
+	for (i = 0; i < rs->nroots; i++)
+		syn_error |= s[i];
+	return syn_error;
+}
+
+/* Compute syndromes (poly form) of a codeword given as segments of a frame,
+ * see RSSeg. Returns non-zero if any syndrome is non-zero.
+ * Horner scheme s[i] = s[i]*alpha**((fcr+i)*prim) + data[j], with four
+ * syndromes packed in a 32 bit word and evaluated in one pass over the data.
+ */
+int syndromes_rs_char(void *arg, const RSSeg *seg, int nseg, unsigned char *s)
+{
+	struct rs *rs = (struct rs *)arg;
+	int i, j, k;
+	const int tl = rs->nn+1;
+
+	if (!rsc_use_packed)
+		return syndromes_ref(rs, seg, nseg, s);
+	for (i = 0; i+4 <= rs->nroots; i += 4) {
+		const unsigned char *m0 = rs->synmul + i*tl;
+		const unsigned char *m1 = m0 + tl;
+		const unsigned char *m2 = m1 + tl;
+		const unsigned char *m3 = m2 + tl;
+		uint32_t w = 0;
+		for (k = 0; k < nseg; k++) {
+			const unsigned char *p = seg[k].p;
+			const int stride = seg[k].stride;
+			for (j = seg[k].n; j > 0; j--, p += stride) {
+				w = ( m0[w&0xFF] | (m1[(w>>8)&0xFF]<<8) | (m2[(w>>16)&0xFF]<<16) |
+					((uint32_t)m3[w>>24]<<24) ) ^ (*p * 0x01010101u);
+			}
+		}
+		s[i] = w&0xFF;
+		s[i+1] = (w>>8)&0xFF;
+		s[i+2] = (w>>16)&0xFF;
+		s[i+3] = w>>24;
+	}
+	for (; i < rs->nroots; i++) {
+		const unsigned char *m = rs->synmul + i*tl;
+		unsigned char v = 0;
+		for (k = 0; k < nseg; k++) {
+			const unsigned char *p = seg[k].p;
+			for (j = seg[k].n; j > 0; j--, p += seg[k].stride)
+				v = m[v] ^ *p;
+		}
+		s[i] = v;
+	}
+	int syn_error = 0;
+	for (i = 0; i < rs->nroots; i++)
+		syn_error |= s[i];
+	return syn_error;
+}
+
 int decode_rs_char(void *arg,
 		   unsigned char *data, int *eras_pos, int no_eras)
 {
 	struct rs *rs = (struct rs *)arg;
+	unsigned char s[MAXROOTS];
+
+	if (rs == NULL)
+		return -1;
+	if (rs->magic != MAGIC)
+		return -1;
+
+	/* form the syndromes; i.e., evaluate data(x) at roots of g(x) */
+	RSSeg seg = { data, rs->nn-rs->pad, 1 };
+	int syn_error = syndromes_rs_char(rs, &seg, 1, s);
+	if (!syn_error) {
+		/* if syndrome is zero, data[] is a codeword and there are no
+		* errors to correct. So return data[] unmodified
+		*/
+		return 0;
+	}
+	return decode_rs_syn(rs, data, s, eras_pos, no_eras);
+}
+
+/* Decoder with precomputed (non-zero) syndromes s[] in poly form */
+int decode_rs_syn(void *arg, unsigned char *data, unsigned char *s,
+		   int *eras_pos, int no_eras)
+{
+	struct rs *rs = (struct rs *)arg;
 
 	if (rs == NULL)
 		return -1;
@@ -209,40 +337,16 @@ int decode_rs_char(void *arg,
 	int i, j, r,k;
 
 	unsigned char u,q,tmp,num1,num2,den,discr_r;
-	unsigned char lambda[rs->nroots+1], s[rs->nroots];	/* Err+Eras Locator poly
-					 * and syndrome poly */
-	unsigned char b[rs->nroots+1], t[rs->nroots+1], omega[rs->nroots+1];
-	unsigned char root[rs->nroots], reg[rs->nroots+1], loc[rs->nroots];
-	int syn_error, count;
+	unsigned char lambda[MAXROOTS+1];	/* Err+Eras Locator poly */
+	unsigned char b[MAXROOTS+1], t[MAXROOTS+1], omega[MAXROOTS+1];
+	unsigned char root[MAXROOTS], reg[MAXROOTS+1], loc[MAXROOTS];
+	int count;
 
-	/* form the syndromes; i.e., evaluate data(x) at roots of g(x) */
-	for (i = 0; i < rs->nroots; i++)
-		s[i] = data[0];
-
-	for (j = 1; j < rs->nn-rs->pad; j++) {
-		for(i=0;i<rs->nroots;i++) {
-			if(s[i] == 0) {
-				s[i] = data[j];
-			} else {
-				s[i] = data[j] ^ rs->alpha_to[MODNN(rs->index_of[s[i]] + (rs->fcr+i)*rs->prim)];
-			}
-		}
-	}
-
-	/* Convert syndromes to index form, checking for nonzero condition */
-	syn_error = 0;
+	/* Convert syndromes to index form */
 	for (i = 0; i < rs->nroots; i++) {
-		syn_error |= s[i];
 		s[i] = rs->index_of[s[i]];
 	}
 
-	if (!syn_error) {
-		/* if syndrome is zero, data[] is a codeword and there are no
-		* errors to correct. So return data[] unmodified
-		*/
-		count = 0;
-		goto finish;
-	}
 	memset(&lambda[1], 0, rs->nroots*sizeof(lambda[0]));
 	lambda[0] = 1;
 
@@ -254,7 +358,7 @@ int decode_rs_char(void *arg,
 		for (j = i+1; j > 0; j--) {
 			tmp = rs->index_of[lambda[j - 1]];
 			if(tmp != rs->nn)
-			  lambda[j] ^= rs->alpha_to[MODNN(u + tmp)];
+			  lambda[j] ^= ALPHA_SUM(u + tmp);
 		}
 	}
 
@@ -308,7 +412,7 @@ int decode_rs_char(void *arg,
 		discr_r = 0;
 		for (i = 0; i < r; i++) {
 			if ((lambda[i] != 0) && (s[r-i-1] != rs->nn)) {
-				discr_r ^= rs->alpha_to[MODNN(rs->index_of[lambda[i]] + s[r-i-1])];
+				discr_r ^= ALPHA_SUM(rs->index_of[lambda[i]] + s[r-i-1]);
 			}
 		}
 		discr_r = rs->index_of[discr_r];	/* Index form */
@@ -321,7 +425,7 @@ int decode_rs_char(void *arg,
 			t[0] = lambda[0];
 			for (i = 0 ; i < rs->nroots; i++) {
 				if(b[i] != rs->nn)
-					t[i+1] = lambda[i+1] ^ rs->alpha_to[MODNN(discr_r + b[i])];
+					t[i+1] = lambda[i+1] ^ ALPHA_SUM(discr_r + b[i]);
 				else
 					t[i+1] = lambda[i+1];
 			}
@@ -391,7 +495,7 @@ int decode_rs_char(void *arg,
 		tmp = 0;
 		for (j = i; j >= 0; j--) {
 			if ((s[i - j] != rs->nn) && (lambda[j] != rs->nn))
-			tmp ^= rs->alpha_to[MODNN(s[i - j] + lambda[j])];
+			tmp ^= ALPHA_SUM(s[i - j] + lambda[j]);
 		}
 		omega[i] = rs->index_of[tmp];
 	}
@@ -422,7 +526,7 @@ int decode_rs_char(void *arg,
 		#endif
 		/* Apply error to data */
 		if (num1 != 0 && loc[j] >= rs->pad) {
-			data[loc[j]-rs->pad] ^= rs->alpha_to[MODNN(rs->index_of[num1] + rs->index_of[num2] + rs->nn - rs->index_of[den])];
+			data[loc[j]-rs->pad] ^= ALPHA_SUM(rs->index_of[num1] + rs->index_of[num2] + rs->nn - rs->index_of[den]);
 		}
 	}
 	finish: